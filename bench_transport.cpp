@@ -0,0 +1,332 @@
+/* Benchmarks for building and relighting the light transport matrix.       */
+/* Run without the viewer:                                                  */
+/*     ./bench_transport [path/to/scene/folder] [resolution]                  */
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <stdint.h>
+#include <string>
+#include <iomanip>
+#include <algorithm>
+#include "omp.h"
+
+#include "transport.h"
+#include "wavelet.h"
+#include "image.h"
+#include "lodepng.h"
+#include "environment.h"
+#include "relight.h"
+#include "tiled.h"
+
+using namespace std;
+
+/* The per-pixel gather/scatter Haar pass transform_pixel_rows replaced */
+void reference_pixel_rows(float **cols, int num_lights, size_t count) {
+	vector<float> row;
+	for (size_t pixel=0; pixel<count; pixel++) {
+		for (int i=0; i<num_lights; i++) {
+			row.push_back(cols[i][pixel]);
+		}
+		haar2d(row);
+		for (int i=0; i<num_lights; i++) {
+			cols[i][pixel] = row[i];
+		}
+		row.clear();
+	}
+}
+
+/* Decodes one channel of every light in 'scene', untransformed */
+vector<float*> load_red_columns(const Scene &scene, unsigned int resolution) {
+	const int num_files = scene.files.size();
+	size_t pixels = (size_t)resolution * resolution;
+	vector<float*> cols(num_files);
+	vector<unsigned> errors(num_files, 0);
+	#pragma omp parallel
+	{
+		vector<float> green(pixels), blue(pixels);
+		#pragma omp for schedule(dynamic)
+		for (int i=0; i<num_files; i++) {
+			cols[i] = new float[pixels];
+			errors[i] = load_light(scene, i, resolution, resolution, cols[i], &green[0], &blue[0]);
+		}
+	}
+	check_light_errors(errors, resolution, resolution);
+	return cols;
+}
+
+vector<float*> copy_columns(const vector<float*> &cols, size_t pixels) {
+	vector<float*> copy(cols.size());
+	for (unsigned int i=0; i<cols.size(); i++) {
+		copy[i] = new float[pixels];
+		memcpy(copy[i], cols[i], pixels*sizeof(float));
+	}
+	return copy;
+}
+
+void free_columns(vector<float*> &cols) {
+	for (unsigned int i=0; i<cols.size(); i++) delete [] cols[i];
+	cols.clear();
+}
+
+static bool larger_weight(const pair<int,float> &a, const pair<int,float> &b) {
+	return a.second > b.second;
+}
+
+/* Lights of one channel of 'env' in light order */
+LightList channel_lights(const vector<float> &env, unsigned int env_resolution, const Wavelet &wavelet) {
+	ShiftedCoefficients coeffs;
+	reset_shifted_coefficients(coeffs, env, env_resolution, wavelet);
+	const vector<float> &haar = shifted_coefficients(coeffs, 0);
+	LightList lights;
+	for (unsigned int i=0; i<haar.size(); i++)
+		lights.push_back(make_pair(i, haar[i]));
+	return lights;
+}
+
+/* Per channel energy, |coefficient| * column norm, as the viewer's energy sort */
+struct LargerEnergy {
+	const ColumnStats *stats;
+	bool operator()(const pair<int,float> &a, const pair<int,float> &b) const {
+		return fabsf(a.second) * stats->norm[a.first] > fabsf(b.second) * stats->norm[b.first];
+	}
+};
+
+/* The same, ordered as the viewer's default sort does */
+LightList sorted_lights(const vector<float> &env, unsigned int env_resolution, const Wavelet &wavelet) {
+	LightList lights = channel_lights(env, env_resolution, wavelet);
+	sort(lights.begin(), lights.end(), larger_weight);
+	return lights;
+}
+
+/* Seconds per frame of 'relight', best of a few runs */
+template <typename Relight>
+double time_frames(Relight relight, int num_wavelets, vector<float> &image) {
+	double best = 1e30;
+	for (int run=0; run<5; run++) {
+		fill(image.begin(), image.end(), 0.0f);
+		double start = omp_get_wtime();
+		relight(num_wavelets, &image[0]);
+		best = min(best, omp_get_wtime() - start);
+	}
+	return best;
+}
+
+struct DenseFrame {
+	const Transport *t;
+	const LightList *lights;
+	float operator()(int n, float *image) const {
+		return relight_dense(*t, lights[0], lights[1], lights[2], n, image);
+	}
+};
+
+struct TiledFrame {
+	const TiledChannel *tiles;
+	const LightList *lights;
+	float operator()(int n, float *image) const {
+		return relight_tiled(tiles[0], tiles[1], tiles[2], lights[0], lights[1], lights[2], n, image);
+	}
+};
+
+struct InterleavedFrame {
+	const InterleavedColumns *cols;
+	const LightList *lights;
+	float operator()(int n, float *image) const {
+		return relight_interleaved(*cols, lights[0], lights[1], lights[2], n, image);
+	}
+};
+
+/*
+Per channel rankings against one shared ranking, on the dense and interleaved
+stores. The per channel energy sort ranks by the same score as the shared one,
+channel by channel. Quality is the PSNR against the image lit by every light
+*/
+void bench_shared(Transport &t, const Scene &scene, const vector<float> &red,
+	const vector<float> &green, const vector<float> &blue, const LightList *lights) {
+	LightList shared[3] = {channel_lights(red, scene.env_resolution, scene.wavelet),
+		channel_lights(green, scene.env_resolution, scene.wavelet),
+		channel_lights(blue, scene.env_resolution, scene.wavelet)};
+	LightList energy[3] = {shared[0], shared[1], shared[2]};
+	const ColumnStats *stats[3] = {&t.red_stats, &t.green_stats, &t.blue_stats};
+	for (int c=0; c<3; c++) {
+		LargerEnergy larger = {stats[c]};
+		sort(energy[c].begin(), energy[c].end(), larger);
+	}
+	rank_shared_lights(t, shared[0], shared[1], shared[2]);
+	InterleavedColumns cols;
+	build_interleaved_columns(t, false, cols);
+	DenseFrame dense = {&t, lights};
+	DenseFrame dense_shared = {&t, shared};
+	InterleavedFrame interleaved_split = {&cols, energy};
+	InterleavedFrame interleaved = {&cols, shared};
+	
+	const size_t count = 3*(size_t)t.width*t.height;
+	vector<float> reference(count, 0.0f), image(count), energy_image(count), shared_image(count);
+	relight_dense(t, lights[0], lights[1], lights[2], t.num_lights, &reference[0]);
+	
+	cout << "shared ranking (Grace, ms per frame, PSNR against all lights)" << endl;
+	cout << "                 dense                 interleaved            speedup of shared" << endl;
+	cout << "   lights   coefficient   shared   energy   shared   over dense   over energy"
+		<< "   PSNR coefficient   energy   shared" << endl;
+	const int counts[] = {150, 900, (int)t.num_lights};
+	for (int n=0; n<3; n++) {
+		int num_wavelets = min(counts[n], (int)t.num_lights);
+		double dense_time = time_frames(dense, num_wavelets, image);
+		double shared_time = time_frames(dense_shared, num_wavelets, shared_image);
+		double split_time = time_frames(interleaved_split, num_wavelets, energy_image);
+		double interleaved_time = time_frames(interleaved, num_wavelets, shared_image);
+		cout << "   " << setw(6) << num_wavelets << fixed << setprecision(2) << setw(14)
+			<< dense_time*1000 << setw(9) << shared_time*1000 << setw(9) << split_time*1000
+			<< setw(9) << interleaved_time*1000 << setw(12) << dense_time / interleaved_time << "x"
+			<< setw(13) << split_time / interleaved_time << "x"
+			<< setw(19) << image_psnr(&reference[0], &image[0], count)
+			<< setw(9) << image_psnr(&reference[0], &energy_image[0], count)
+			<< setw(9) << image_psnr(&reference[0], &shared_image[0], count) << endl;
+		cout.unsetf(ios::floatfield);
+		cout << setprecision(6);
+	}
+	free_interleaved_columns(cols);
+}
+
+/* Relights the whole scene from its column and tiled layouts */
+void bench_relight(const Scene &scene, unsigned int resolution) {
+	Transport t = Transport();
+	build_transport_matrix(t, scene, resolution, resolution, 0);
+	TiledChannel tiles[3];
+	build_tiled_channels(t, false, tiles[0], tiles[1], tiles[2]);
+	
+	vector<float> red, green, blue;
+	load_environment_map("Grace", scene.env_resolution, red, green, blue);
+	LightList lights[3] = {sorted_lights(red, scene.env_resolution, scene.wavelet),
+		sorted_lights(green, scene.env_resolution, scene.wavelet),
+		sorted_lights(blue, scene.env_resolution, scene.wavelet)};
+	DenseFrame dense = {&t, lights};
+	TiledFrame tiled = {tiles, lights};
+	
+	cout << "relight (Grace, ms per frame)" << endl;
+	cout << "   lights    columns    " << TILE_SIZE << "x" << TILE_SIZE << " tiles   speedup   max difference" << endl;
+	const int counts[] = {150, 900, (int)t.num_lights};
+	vector<float> column_image(3*(size_t)resolution*resolution), tiled_image(column_image.size());
+	for (int n=0; n<3; n++) {
+		int num_wavelets = min(counts[n], (int)t.num_lights);
+		double column_time = time_frames(dense, num_wavelets, column_image);
+		double tiled_time = time_frames(tiled, num_wavelets, tiled_image);
+		float difference = 0.0f;
+		for (size_t i=0; i<column_image.size(); i++)
+			difference = max(difference, fabsf(column_image[i] - tiled_image[i]));
+		cout << "   " << setw(6) << num_wavelets << setw(11) << fixed << setprecision(2)
+			<< column_time*1000 << setw(13) << tiled_time*1000 << setw(9) << column_time / tiled_time
+			<< "x" << setw(17) << scientific << setprecision(2) << difference << endl;
+		cout.unsetf(ios::floatfield);
+		cout << setprecision(6);
+	}
+	for (int c=0; c<3; c++)
+		free_tiled_channel(tiles[c]);
+	
+	bench_shared(t, scene, red, green, blue, lights);
+	free_transport(t);
+}
+
+/* Distance in units in the last place between two non-negative floats */
+static uint32_t ulps(float a, float b) {
+	uint32_t x, y;
+	memcpy(&x, &a, sizeof(x));
+	memcpy(&y, &b, sizeof(y));
+	return x > y ? x - y : y - x;
+}
+
+/*
+Checks decode_png_planar's 1/255 multiply against the old /255.0f division,
+for every byte value and for the first light of 'scene' decoded both ways
+*/
+void check_png_decode(const Scene &scene) {
+	const float scale = 1.0f / 255.0f;
+	uint32_t table_ulps = 0;
+	for (int b=0; b<256; b++)
+		table_ulps = max(table_ulps, ulps(b * scale, b / 255.0f));
+	cout << "png decode" << endl;
+	cout << "   byte values:        " << table_ulps << " ulp" << endl;
+	
+	const char *filename = NULL;
+	for (unsigned int i=0; i<scene.files.size() && !filename; i++) {
+		const string &name = scene.files[i];
+		if (name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".png") == 0)
+			filename = name.c_str();
+	}
+	if (!filename) {
+		cout << "   no PNG lights" << endl << endl;
+		return;
+	}
+	
+	unsigned char *rgb = NULL;
+	unsigned int w, h;
+	if (lodepng_decode24_file(&rgb, &w, &h, filename)) {
+		cout << "   could not decode " << filename << endl << endl;
+		free(rgb);
+		return;
+	}
+	size_t count = (size_t)w * h;
+	vector<float> planes(3*count);
+	unsigned error = decode_png_planar(filename, w, h, &planes[0], &planes[count], &planes[2*count]);
+	uint32_t file_ulps = 0;
+	for (size_t p=0; p<count && !error; p++)
+		for (int c=0; c<3; c++)
+			file_ulps = max(file_ulps, ulps(planes[c*count + p], rgb[3*p + c] / 255.0f));
+	free(rgb);
+	
+	cout << "   " << filename << ": " << w << "x" << h;
+	if (error)
+		cout << ", decode_png_planar failed: " << image_error_text(error) << endl << endl;
+	else
+		cout << ", " << file_ulps << " ulp" << endl << endl;
+}
+
+int main(int argc, char* argv[]) {
+	const char *folder = argc > 1 ? argv[1] : "scenes/tree";
+	unsigned int resolution = argc > 2 ? atoi(argv[2]) : 256;
+	size_t pixels = (size_t)resolution * resolution;
+	
+	Scene scene;
+	load_scene(scene, folder);
+	int num_files = scene.files.size();
+	
+	cout << folder << ": " << num_files << " lights, " << resolution << "x" << resolution
+		<< ", " << omp_get_max_threads() << " threads" << endl;
+	
+	check_png_decode(scene);
+	
+	vector<float*> source = load_red_columns(scene, resolution);
+	
+	/* Haar pass over one channel, old per-pixel gather vs light major bands */
+	vector<float*> reference = copy_columns(source, pixels);
+	double start = omp_get_wtime();
+	reference_pixel_rows(&reference[0], num_files, pixels);
+	double reference_time = omp_get_wtime() - start;
+	
+	vector<float*> blocked = copy_columns(source, pixels);
+	Wavelet haar = {WAVELET_HAAR, NONSTANDARD};
+	start = omp_get_wtime();
+	transform_pixel_rows(&blocked[0], num_files, pixels, haar, NULL);
+	double blocked_time = omp_get_wtime() - start;
+	
+	float max_error = 0.0f;
+	for (int i=0; i<num_files; i++)
+		for (size_t p=0; p<pixels; p++)
+			max_error = max(max_error, fabsf(reference[i][p] - blocked[i][p]));
+	
+	cout << "haar pass (one channel)" << endl;
+	cout << "   per-pixel gather:   " << reference_time << " s" << endl;
+	cout << "   light major band:   " << blocked_time << " s ("
+		<< reference_time / blocked_time << "x)" << endl;
+	cout << "   max difference:     " << max_error << endl;
+	
+	free_columns(source);
+	free_columns(reference);
+	free_columns(blocked);
+	
+	bench_relight(scene, resolution);
+	return 0;
+}
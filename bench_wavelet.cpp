@@ -0,0 +1,568 @@
+/* Benchmarks and round trip checks for the wavelet transform of light vectors. */
+/* Run without the viewer: ./bench_wavelet [-r resolution] [scene folder ...]  */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "omp.h"
+
+#include "environment.h"
+#include "transport.h"
+#include "wavelet.h"
+
+using namespace std;
+
+const char *ENVIRONMENTS[] = {"Grace", "Grove", "Beach", "AreaLight"};
+const int NUM_ENVIRONMENTS = 4;
+const double ERRORS[] = {0.01, 0.05, 0.10};
+const int NUM_ERRORS = 3;
+const unsigned int PIXEL_STRIDE = 64;
+const int KERNEL_REPEATS = 20000;
+const size_t THROUGHPUT_FLOATS = 64 << 20;
+
+/* Back to cout's default float format after the tables that change it */
+void default_format() {
+	cout.unsetf(ios_base::floatfield);
+	cout.precision(6);
+}
+
+/* The 1d haar step haar2d used to call, with a heap buffer per call */
+void reference_haar(vector<float>::iterator vec, int w, int res, bool is_col){
+	float *tmp = new float[w];
+	memset(tmp, 0, sizeof(float)*w);
+	
+	int offset = is_col ? res : 1;
+	
+	w /= 2;
+	for (int i=0; i<w; i++) {
+		tmp[i] = (vec[2*i*offset] + vec[(2*i+1)*offset]) / sqrt(2.0);
+		tmp[i+w] = (vec[2*i*offset] - vec[(2*i+1)*offset]) / sqrt(2.0);
+	}
+	for (int i=0; i<2*w; i++) {
+		vec[i*offset] = tmp[i];
+	}
+	delete [] tmp;
+}
+
+/*
+The transform haar2d used to do: one sqrt(size) x sqrt(size) square over the
+stacked faces, leaving the tail of the vector untransformed
+*/
+void reference_haar2d(vector<float>& vec){
+	int resolution = sqrt(vec.size());
+	int w = resolution;
+	while (w>1)	{
+		vector<float>::iterator row_iter = vec.begin();
+		for (int i=0; i<resolution; i++){
+			reference_haar(row_iter,w,resolution,false);
+			row_iter += resolution;
+		}
+		vector<float>::iterator col_iter = vec.begin();
+		for (int i=0; i<resolution; i++){
+			reference_haar(col_iter,w,resolution,true);
+			col_iter += 1;
+		}
+		w /= 2;
+	}
+}
+
+/* Per face transform built on the allocating reference_haar */
+void reference_haar2d_faces(vector<float>& vec){
+	int resolution = cubemap_resolution(vec.size());
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		vector<float>::iterator face = vec.begin() + f*resolution*resolution;
+		for (int w=resolution; w>1; w/=2) {
+			for (int i=0; i<w; i++) reference_haar(face + i*resolution, w, resolution, false);
+			for (int i=0; i<w; i++) reference_haar(face + i, w, resolution, true);
+		}
+	}
+}
+
+/*
+Number of largest magnitude coefficients needed so that the dropped ones
+hold at most error^2 of the energy, ie relative L2 error <= 'error'
+*/
+size_t coefficients_for_error(const vector<float> &coeffs, double error) {
+	vector<double> energy(coeffs.size());
+	double total = 0.0;
+	for (size_t i=0; i<coeffs.size(); i++) {
+		energy[i] = (double)coeffs[i]*coeffs[i];
+		total += energy[i];
+	}
+	if (total == 0.0) return 0;
+	sort(energy.begin(), energy.end());
+
+	double budget = error*error*total;
+	double dropped = 0.0;
+	size_t count = energy.size();
+	for (size_t i=0; i<energy.size() && dropped + energy[i] <= budget; i++) {
+		dropped += energy[i];
+		count--;
+	}
+	return count;
+}
+
+/* Accumulates coefficient counts of 'vec' at each error under both transforms */
+void add_counts(const vector<float> &vec, double *old_counts, double *new_counts) {
+	vector<float> old_coeffs(vec);
+	vector<float> new_coeffs(vec);
+	reference_haar2d(old_coeffs);
+	haar2d(new_coeffs);
+	for (int e=0; e<NUM_ERRORS; e++) {
+		old_counts[e] += coefficients_for_error(old_coeffs, ERRORS[e]);
+		new_counts[e] += coefficients_for_error(new_coeffs, ERRORS[e]);
+	}
+}
+
+void print_counts(const char *name, const double *old_counts, const double *new_counts, double samples) {
+	cout << "   " << setw(12) << left << name << right;
+	for (int e=0; e<NUM_ERRORS; e++) {
+		cout << setw(9) << fixed << setprecision(1) << old_counts[e] / samples
+			<< " ->" << setw(7) << new_counts[e] / samples;
+	}
+	cout << endl;
+}
+
+void print_header(const char *what) {
+	cout << what << ", coefficients for relative L2 error (flat -> per face)" << endl;
+	cout << "   " << setw(12) << " ";
+	for (int e=0; e<NUM_ERRORS; e++) {
+		cout << setw(16) << fixed << setprecision(0) << ERRORS[e]*100 << "%  ";
+	}
+	cout << endl;
+}
+
+/*
+Fewest largest magnitude coefficients of 'vec' under 'wavelet' whose inverse
+transform is within relative L2 'error' of 'vec'. Unlike
+coefficients_for_error this holds for the biorthogonal bases too
+*/
+size_t coefficients_for_reconstruction(const vector<float> &vec, const Wavelet &wavelet, double error) {
+	vector<float> coeffs(vec), scratch;
+	wavelet2d(coeffs, wavelet, WAVELET_FORWARD, scratch);
+	
+	vector< pair<float,int> > order(coeffs.size());
+	for (size_t i=0; i<coeffs.size(); i++) order[i] = make_pair(-fabsf(coeffs[i]), (int)i);
+	sort(order.begin(), order.end());
+	
+	double norm = 0.0;
+	for (size_t i=0; i<vec.size(); i++) norm += (double)vec[i]*vec[i];
+	
+	/* Binary search the count, the error is close enough to monotonic in it */
+	size_t low = 0, high = vec.size();
+	vector<float> kept(vec.size());
+	while (low < high) {
+		size_t count = (low + high) / 2;
+		fill(kept.begin(), kept.end(), 0.0f);
+		for (size_t k=0; k<count; k++) kept[order[k].second] = coeffs[order[k].second];
+		wavelet2d(kept, wavelet, WAVELET_INVERSE, scratch);
+		double dropped = 0.0;
+		for (size_t i=0; i<vec.size(); i++) dropped += (double)(kept[i] - vec[i])*(kept[i] - vec[i]);
+		if (dropped <= error*error*norm) high = count;
+		else low = count + 1;
+	}
+	return low;
+}
+
+/* Accumulates coefficients needed at each error in every basis */
+void add_basis_counts(const vector<float> &vec, double counts[][NUM_ERRORS]) {
+	for (int b=0; b<NUM_WAVELETS; b++) {
+		Wavelet wavelet = {b, NONSTANDARD};
+		for (int e=0; e<NUM_ERRORS; e++)
+			counts[b][e] += coefficients_for_reconstruction(vec, wavelet, ERRORS[e]);
+	}
+}
+
+void print_basis_counts(const char *name, double counts[][NUM_ERRORS], double samples) {
+	cout << "   " << setw(12) << left << name << right;
+	for (int e=0; e<NUM_ERRORS; e++) {
+		cout << "  ";
+		for (int b=0; b<NUM_WAVELETS; b++)
+			cout << setw(7) << fixed << setprecision(1) << counts[b][e] / samples;
+	}
+	cout << endl;
+}
+
+/* Forward transform time of each basis on KERNEL_REPEATS light vectors */
+void basis_benchmark(const vector<float> &vec) {
+	default_format();
+	cout << "bases, " << KERNEL_REPEATS << " light vectors" << endl;
+	vector<float> work, scratch;
+	for (int b=0; b<NUM_WAVELETS; b++) {
+		for (int d=0; d<NUM_DECOMPOSITIONS; d++) {
+			Wavelet wavelet = {b, d};
+			double start = omp_get_wtime();
+			for (int r=0; r<KERNEL_REPEATS; r++) {
+				work = vec;
+				wavelet2d(work, wavelet, WAVELET_FORWARD, scratch);
+			}
+			double forward_time = omp_get_wtime() - start;
+			vector<float> coeffs(work);
+			start = omp_get_wtime();
+			for (int r=0; r<KERNEL_REPEATS; r++) {
+				work = coeffs;
+				wavelet2d(work, wavelet, WAVELET_INVERSE, scratch);
+			}
+			double inverse_time = omp_get_wtime() - start;
+			float round_trip = 0.0f;
+			for (size_t i=0; i<vec.size(); i++)
+				round_trip = max(round_trip, fabsf(work[i] - vec[i]));
+			cout << "   " << setw(6) << left << wavelet_name(b) << setw(12) << decomposition_name(d)
+				<< right << " forward " << forward_time << " s, inverse " << inverse_time
+				<< " s, round trip " << round_trip << endl;
+		}
+	}
+	cout << endl;
+}
+
+/*
+Times KERNEL_REPEATS transforms of 'vec' with the allocating reference and the
+lifting kernel, and checks both against each other and the inverse
+*/
+void kernel_benchmark(const vector<float> &vec) {
+	default_format();
+	vector<float> work(vec);
+	double start = omp_get_wtime();
+	for (int r=0; r<KERNEL_REPEATS; r++) {
+		work = vec;
+		reference_haar2d_faces(work);
+	}
+	double reference_time = omp_get_wtime() - start;
+	vector<float> expected(work);
+	
+	vector<float> scratch;
+	start = omp_get_wtime();
+	for (int r=0; r<KERNEL_REPEATS; r++) {
+		work = vec;
+		haar2d(work, scratch);
+	}
+	double lifting_time = omp_get_wtime() - start;
+	
+	float max_difference = 0.0f;
+	for (size_t i=0; i<vec.size(); i++)
+		max_difference = max(max_difference, fabsf(work[i] - expected[i]));
+	
+	start = omp_get_wtime();
+	for (int r=0; r<KERNEL_REPEATS; r++) {
+		work = expected;
+		inverse_haar2d(work, scratch);
+	}
+	double inverse_time = omp_get_wtime() - start;
+	
+	float round_trip = 0.0f;
+	for (size_t i=0; i<vec.size(); i++)
+		round_trip = max(round_trip, fabsf(work[i] - vec[i]));
+	
+	cout << "haar kernel, " << KERNEL_REPEATS << " light vectors" << endl;
+	cout << "   allocating haar:    " << reference_time << " s" << endl;
+	cout << "   lifting, forward:   " << lifting_time << " s ("
+		<< reference_time / lifting_time << "x)" << endl;
+	cout << "   lifting, inverse:   " << inverse_time << " s" << endl;
+	cout << "   max difference:     " << max_difference << endl;
+	cout << "   round trip error:   " << round_trip << endl << endl;
+}
+
+/*
+Steps the environment through every row shift twice, as the arrow keys do,
+comparing a full transform per step with reset_shifted_coefficients, which
+fills small environments up front, and the memoized steps after it
+*/
+void shift_benchmark(const vector<float> &env, unsigned int resolution) {
+	default_format();
+	int total_rows = CUBEMAP_FACES * resolution;
+	vector<float> rotated(env);
+	vector<float> work;
+	vector<float> scratch;
+	
+	double start = omp_get_wtime();
+	for (int step=0; step<2*total_rows; step++) {
+		rotate(rotated.begin(), rotated.begin() + resolution, rotated.end());
+		work = rotated;
+		haar2d(work, scratch);
+	}
+	double full_time = omp_get_wtime() - start;
+	
+	ShiftedCoefficients coeffs;
+	Wavelet haar = {WAVELET_HAAR, NONSTANDARD};
+	start = omp_get_wtime();
+	reset_shifted_coefficients(coeffs, env, resolution, haar);
+	double reset_time = omp_get_wtime() - start;
+	float max_difference = 0.0f;
+	volatile float sink = 0.0f;
+	start = omp_get_wtime();
+	for (int step=0; step<2*total_rows; step++) {
+		sink = shifted_coefficients(coeffs, step + 1)[0];
+	}
+	double memo_time = omp_get_wtime() - start;
+	(void)sink;
+	
+	/* Check every shift, including negative ones, against a fresh transform */
+	for (int shift=-total_rows; shift<=total_rows; shift++) {
+		int amount = ((shift % total_rows) + total_rows) % total_rows;
+		work.resize(env.size());
+		rotate_copy(env.begin(), env.begin() + amount*resolution, env.end(), work.begin());
+		haar2d(work, scratch);
+		const vector<float> &memo = shifted_coefficients(coeffs, shift);
+		for (size_t i=0; i<work.size(); i++)
+			max_difference = max(max_difference, fabsf(work[i] - memo[i]));
+	}
+	
+	cout << "environment shift, " << 2*total_rows << " steps" << endl;
+	cout << "   transform per step: " << full_time*1e3 << " ms" << endl;
+	cout << "   reset:              " << reset_time*1e3 << " ms ("
+		<< (total_rows*env.size() <= ENV_PRECOMPUTE_FLOATS ? "every shift" : "lazy") << ")" << endl;
+	cout << "   memoized steps:     " << memo_time*1e3 << " ms" << endl;
+	cout << "   max difference:     " << max_difference << endl << endl;
+}
+
+void print_basis_header() {
+	cout << "coefficients for relative L2 error after the inverse transform" << endl;
+	cout << "   " << setw(12) << " ";
+	for (int e=0; e<NUM_ERRORS; e++) {
+		cout << setw(2 + 7*NUM_WAVELETS - 2) << fixed << setprecision(0) << ERRORS[e]*100 << "%  ";
+	}
+	cout << endl << "   " << setw(12) << " ";
+	for (int e=0; e<NUM_ERRORS; e++) {
+		cout << "  ";
+		for (int b=0; b<NUM_WAVELETS; b++) cout << setw(7) << wavelet_name(b);
+	}
+	cout << endl;
+}
+
+/* Rows packed PIXEL_BLOCK to a band, light major, as transform_pixel_rows sees them */
+struct Bands {
+	int num_lights;
+	vector< vector<float> > data;
+	vector<int> lanes;
+};
+
+Bands pack_bands(const vector< vector<float> > &rows) {
+	Bands bands;
+	bands.num_lights = rows.empty() ? 0 : rows[0].size();
+	for (size_t start=0; start<rows.size(); start+=PIXEL_BLOCK) {
+		int lanes = min((size_t)PIXEL_BLOCK, rows.size() - start);
+		vector<float> band((size_t)bands.num_lights * PIXEL_BLOCK, 0.0f);
+		for (int p=0; p<lanes; p++)
+			for (int i=0; i<bands.num_lights; i++)
+				band[(size_t)i*PIXEL_BLOCK + p] = rows[start + p][i];
+		bands.data.push_back(band);
+		bands.lanes.push_back(lanes);
+	}
+	return bands;
+}
+
+/* Enough passes over 'floats' floats to run for a measurable time */
+int passes_for(size_t floats) {
+	return max((size_t)1, THROUGHPUT_FLOATS / max((size_t)1, floats));
+}
+
+/*
+Forward and inverse throughput of every variant over the bands on one
+thread, counting each float transformed once, and the worst round trip
+error relative to the largest input value
+*/
+void throughput_benchmark(const Bands &bands) {
+	size_t floats = 0;
+	float largest = 0.0f;
+	for (size_t b=0; b<bands.data.size(); b++) {
+		floats += (size_t)bands.num_lights * bands.lanes[b];
+		for (size_t i=0; i<bands.data[b].size(); i++)
+			largest = max(largest, fabsf(bands.data[b][i]));
+	}
+	int passes = passes_for(floats);
+	double gigabytes = (double)floats * sizeof(float) * passes / 1e9;
+	
+	cout << "   " << setw(18) << left << "transform" << right << setw(12) << "forward"
+		<< setw(12) << "inverse" << setw(14) << "round trip" << endl;
+	vector<float> scratch;
+	for (int b=0; b<NUM_WAVELETS; b++) {
+		for (int d=0; d<NUM_DECOMPOSITIONS; d++) {
+			Wavelet wavelet = {b, d};
+			vector< vector<float> > work(bands.data);
+			double forward_time = 0.0, inverse_time = 0.0;
+			for (int pass=0; pass<passes; pass++) {
+				double start = omp_get_wtime();
+				for (size_t k=0; k<work.size(); k++)
+					wavelet2d_lanes(&work[k][0], bands.num_lights, PIXEL_BLOCK, bands.lanes[k],
+						wavelet, WAVELET_FORWARD, scratch);
+				forward_time += omp_get_wtime() - start;
+				start = omp_get_wtime();
+				for (size_t k=0; k<work.size(); k++)
+					wavelet2d_lanes(&work[k][0], bands.num_lights, PIXEL_BLOCK, bands.lanes[k],
+						wavelet, WAVELET_INVERSE, scratch);
+				inverse_time += omp_get_wtime() - start;
+			}
+			
+			float round_trip = 0.0f;
+			for (size_t k=0; k<work.size(); k++)
+				for (int i=0; i<bands.num_lights; i++)
+					for (int p=0; p<bands.lanes[k]; p++) {
+						size_t at = (size_t)i*PIXEL_BLOCK + p;
+						round_trip = max(round_trip, fabsf(work[k][at] - bands.data[k][at]));
+					}
+			
+			cout << "   " << setw(6) << left << wavelet_name(b) << setw(12) << decomposition_name(d)
+				<< right << setprecision(2) << fixed
+				<< setw(7) << gigabytes / forward_time << " GB/s"
+				<< setw(7) << gigabytes / inverse_time << " GB/s"
+				<< setw(14) << scientific << setprecision(1) << round_trip / largest << endl;
+		}
+	}
+	cout << fixed;
+}
+
+/* Time spent in each level of the nonstandard forward transform, per basis */
+void level_benchmark(const Bands &bands) {
+	int resolution = cubemap_resolution(bands.num_lights);
+	size_t floats = 0;
+	for (size_t b=0; b<bands.data.size(); b++)
+		floats += (size_t)bands.num_lights * bands.lanes[b];
+	int passes = passes_for(floats);
+	
+	cout << "   nonstandard forward, ms per pass at each level (w x w quadrant)" << endl;
+	cout << "   " << setw(6) << " ";
+	for (int w=resolution; w>1; w/=2) cout << setw(9) << w;
+	cout << setw(9) << "total" << endl;
+	
+	vector<float> scratch;
+	for (int b=0; b<NUM_WAVELETS; b++) {
+		vector<double> level_time;
+		for (int w=resolution; w>1; w/=2) level_time.push_back(0.0);
+		vector< vector<float> > work;
+		for (int pass=0; pass<passes; pass++) {
+			work = bands.data;
+			int level = 0;
+			for (int w=resolution; w>1; w/=2, level++) {
+				double start = omp_get_wtime();
+				for (size_t k=0; k<work.size(); k++)
+					wavelet2d_level(&work[k][0], bands.num_lights, PIXEL_BLOCK, bands.lanes[k], w,
+						b, WAVELET_FORWARD, scratch);
+				level_time[level] += omp_get_wtime() - start;
+			}
+		}
+		double total = 0.0;
+		cout << "   " << setw(6) << left << wavelet_name(b) << right << setprecision(3) << fixed;
+		for (size_t level=0; level<level_time.size(); level++) {
+			cout << setw(9) << level_time[level] * 1e3 / passes;
+			total += level_time[level];
+		}
+		cout << setw(9) << total * 1e3 / passes << endl;
+	}
+}
+
+/* Round trip error of every variant on each environment map */
+void environment_round_trips(unsigned int env_resolution) {
+	cout << "environment maps, worst round trip error relative to the brightest texel" << endl;
+	cout << "   " << setw(12) << " ";
+	for (int b=0; b<NUM_WAVELETS; b++)
+		for (int d=0; d<NUM_DECOMPOSITIONS; d++)
+			cout << setw(9) << wavelet_name(b) << (d == STANDARD ? "/s" : "/n");
+	cout << endl;
+	
+	vector<float> red, green, blue, work, scratch;
+	for (int m=0; m<NUM_ENVIRONMENTS; m++) {
+		load_environment_map(ENVIRONMENTS[m], env_resolution, red, green, blue);
+		cout << "   " << setw(12) << left << ENVIRONMENTS[m] << right;
+		float largest = *max_element(red.begin(), red.end());
+		for (int b=0; b<NUM_WAVELETS; b++) {
+			for (int d=0; d<NUM_DECOMPOSITIONS; d++) {
+				Wavelet wavelet = {b, d};
+				work = red;
+				wavelet2d(work, wavelet, WAVELET_FORWARD, scratch);
+				wavelet2d(work, wavelet, WAVELET_INVERSE, scratch);
+				float round_trip = 0.0f;
+				for (size_t i=0; i<red.size(); i++)
+					round_trip = max(round_trip, fabsf(work[i] - red[i]));
+				cout << setw(11) << scientific << setprecision(1) << round_trip / max(largest, 1e-20f);
+			}
+		}
+		cout << fixed << endl;
+	}
+	cout << endl;
+}
+
+/* How much more compact each transform makes the environments and the rows */
+void sparsity_report(const vector< vector<float> > &rows, unsigned int env_resolution) {
+	vector<float> red, green, blue;
+	
+	/* Environments, as calculate_lights_used sees them */
+	print_header("environment maps");
+	for (int m=0; m<NUM_ENVIRONMENTS; m++) {
+		load_environment_map(ENVIRONMENTS[m], env_resolution, red, green, blue);
+		double old_counts[NUM_ERRORS] = {0}, new_counts[NUM_ERRORS] = {0};
+		add_counts(red, old_counts, new_counts);
+		add_counts(green, old_counts, new_counts);
+		add_counts(blue, old_counts, new_counts);
+		print_counts(ENVIRONMENTS[m], old_counts, new_counts, 3.0);
+	}
+	cout << endl;
+	
+	double old_counts[NUM_ERRORS] = {0}, new_counts[NUM_ERRORS] = {0};
+	double row_basis_counts[NUM_WAVELETS][NUM_ERRORS] = {{0}};
+	for (size_t r=0; r<rows.size(); r++) {
+		add_counts(rows[r], old_counts, new_counts);
+		add_basis_counts(rows[r], row_basis_counts);
+	}
+	print_header("transport rows");
+	print_counts("mean", old_counts, new_counts, rows.size());
+	cout << endl;
+	
+	print_basis_header();
+	for (int m=0; m<NUM_ENVIRONMENTS; m++) {
+		load_environment_map(ENVIRONMENTS[m], env_resolution, red, green, blue);
+		double counts[NUM_WAVELETS][NUM_ERRORS] = {{0}};
+		add_basis_counts(red, counts);
+		add_basis_counts(green, counts);
+		add_basis_counts(blue, counts);
+		print_basis_counts(ENVIRONMENTS[m], counts, 3.0);
+	}
+	print_basis_counts("rows", row_basis_counts, rows.size());
+	cout << endl;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned int resolution = 256;
+	vector<const char*> folders;
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i+1 < argc)
+			resolution = atoi(argv[++i]);
+		else
+			folders.push_back(argv[i]);
+	}
+	if (folders.empty()) {
+		folders.push_back("scenes/sphere");
+		folders.push_back("scenes/teapot");
+		folders.push_back("scenes/tree");
+	}
+	
+	for (unsigned int f=0; f<folders.size(); f++) {
+		Scene scene;
+		load_scene(scene, folders[f]);
+		unsigned int env_resolution = scene.env_resolution;
+		vector< vector<float> > rows = sample_pixel_rows(scene, resolution, PIXEL_STRIDE);
+		Bands bands = pack_bands(rows);
+		
+		cout << folders[f] << ": " << scene.files.size() << " lights (" << env_resolution << "x"
+			<< env_resolution << " per face), " << rows.size() << " lit pixel rows (every "
+			<< PIXEL_STRIDE << "th)" << endl;
+		throughput_benchmark(bands);
+		level_benchmark(bands);
+		cout << endl;
+		
+		/* The rest only depends on the light resolution, so run it once */
+		if (f > 0) continue;
+		environment_round_trips(env_resolution);
+		
+		vector<float> red, green, blue;
+		load_environment_map(ENVIRONMENTS[0], env_resolution, red, green, blue);
+		kernel_benchmark(red);
+		shift_benchmark(red, env_resolution);
+		basis_benchmark(red);
+		sparsity_report(rows, env_resolution);
+	}
+	return 0;
+}
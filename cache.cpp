@@ -0,0 +1,501 @@
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "wavelet.h"
+#include "omp.h"
+
+using namespace std;
+
+static const char CACHE_MAGIC[8] = {'P','R','T','C','A','C','H','E'};
+
+/* FNV-1a, folded over whatever identifies the cache source */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char*) data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment) {
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t hash_stats(uint64_t hash, const ColumnStats &stats) {
+	hash = hash_bytes(hash, &stats.mean[0], stats.mean.size()*sizeof(float));
+	hash = hash_bytes(hash, &stats.norm[0], stats.norm.size()*sizeof(float));
+	hash = hash_bytes(hash, &stats.max_abs[0], stats.max_abs.size()*sizeof(float));
+	return hash_bytes(hash, &stats.nonzeros[0], stats.nonzeros.size()*sizeof(uint32_t));
+}
+
+/*
+Hash of the column statistics of 't'. Files derived from the transport store
+it, since patching any light into the cache changes it
+*/
+uint64_t transport_fingerprint(const Transport &t) {
+	uint64_t hash = hash_stats(FNV_OFFSET, t.red_stats);
+	hash = hash_stats(hash, t.green_stats);
+	return hash_stats(hash, t.blue_stats);
+}
+
+CacheKey transport_cache_key(const Scene &scene, unsigned int width, unsigned int height) {
+	CacheKey key;
+	memset(&key, 0, sizeof(key));
+	key.width = width;
+	key.height = height;
+	key.num_lights = scene.files.size();
+	#ifdef USEHAAR
+	key.transform = TRANSFORM_HAAR + scene.wavelet.basis;
+	if (scene.wavelet.decomposition == STANDARD)
+		key.transform |= TRANSFORM_STANDARD;
+	#else
+	key.transform = TRANSFORM_NONE;
+	#endif
+	
+	/* Which file each light comes from, separated so names cannot run together */
+	uint64_t hash = hash_bytes(FNV_OFFSET, scene.folder.c_str(), scene.folder.size() + 1);
+	for (size_t i=0; i<scene.files.size(); i++)
+		hash = hash_bytes(hash, scene.files[i].c_str(), scene.files[i].size() + 1);
+	key.source_hash = hash;
+	return key;
+}
+
+/* Size and modification time of 'filename', plus its content hash if asked */
+static FileStamp stamp_file(const string &filename, bool with_hash) {
+	FileStamp stamp = {-1, -1, 0};
+	struct stat st;
+	if (filename.empty() || stat(filename.c_str(), &st) != 0) return stamp;
+	stamp.size = st.st_size;
+	stamp.mtime = st.st_mtime;
+	
+	if (with_hash) {
+		stamp.hash = FNV_OFFSET;
+		FILE *file = fopen(filename.c_str(), "rb");
+		if (file) {
+			char buffer[1 << 16];
+			size_t n;
+			while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+				stamp.hash = hash_bytes(stamp.hash, buffer, n);
+			fclose(file);
+		}
+	}
+	return stamp;
+}
+
+/* Stamps of every light image in 'scene', taken before they are decoded */
+vector<FileStamp> stamp_light_files(const Scene &scene) {
+	const int num_files = scene.files.size();
+	vector<FileStamp> stamps(num_files);
+	#pragma omp parallel for schedule(dynamic)
+	for (int i=0; i<num_files; i++) {
+		stamps[i] = stamp_file(scene.files[i], true);
+	}
+	return stamps;
+}
+
+/*
+The stats section holds, for each channel, the mean, norm and max_abs floats
+of every column followed by the nonzero counts
+*/
+static const int STATS_WORDS = 4;
+
+static void pack_stats(const ColumnStats &stats, uint32_t *words) {
+	unsigned int num_lights = stats.mean.size();
+	memcpy(words, &stats.mean[0], num_lights*sizeof(float));
+	memcpy(words + num_lights, &stats.norm[0], num_lights*sizeof(float));
+	memcpy(words + 2*num_lights, &stats.max_abs[0], num_lights*sizeof(float));
+	memcpy(words + 3*num_lights, &stats.nonzeros[0], num_lights*sizeof(uint32_t));
+}
+
+static void unpack_stats(const uint32_t *words, unsigned int num_lights, ColumnStats &stats) {
+	const float *floats = (const float*) words;
+	stats.mean.assign(floats, floats + num_lights);
+	stats.norm.assign(floats + num_lights, floats + 2*num_lights);
+	stats.max_abs.assign(floats + 2*num_lights, floats + 3*num_lights);
+	stats.nonzeros.assign(words + 3*num_lights, words + 4*num_lights);
+}
+
+/* Header of a cache holding 'key', with the sections laid out back to back */
+static CacheHeader make_header(const CacheKey &key) {
+	size_t pixels = (size_t)key.width * key.height;
+	
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.header_size = sizeof(CacheHeader);
+	header.key = key;
+	header.stats_offset = align_up(sizeof(CacheHeader), 64);
+	header.manifest_offset = align_up(header.stats_offset + 3*STATS_WORDS*key.num_lights*sizeof(uint32_t), 64);
+	header.columns_offset = align_up(header.manifest_offset + key.num_lights*sizeof(FileStamp), 4096);
+	header.file_size = header.columns_offset + 3*column_stride(pixels)*key.num_lights*sizeof(float);
+	return header;
+}
+
+/* Whether the mapped 'header' of a 'size' byte file is a complete cache of 'key' */
+static bool valid_header(const CacheHeader *header, const CacheKey &key, uint64_t size) {
+	CacheHeader expected = make_header(key);
+	return memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+		&& header->version == CACHE_VERSION
+		&& header->header_size == sizeof(CacheHeader)
+		&& memcmp(&header->key, &key, sizeof(CacheKey)) == 0
+		&& header->stats_offset == expected.stats_offset
+		&& header->manifest_offset == expected.manifest_offset
+		&& header->columns_offset == expected.columns_offset
+		&& header->file_size == expected.file_size
+		&& size == expected.file_size;
+}
+
+/* Maps the cache at 'path' into 't' if it exists and matches 'key' */
+bool load_transport_cache(Transport &t, const char *path, const CacheKey &key) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+	
+	const CacheHeader *header = (const CacheHeader*) mapping;
+	size_t pixels = (size_t)key.width * key.height;
+	if (!valid_header(header, key, st.st_size)) {
+		munmap(mapping, st.st_size);
+		clog << "Ignoring stale transport cache " << path << "\n";
+		return false;
+	}
+	
+	t.width = key.width;
+	t.height = key.height;
+	t.num_lights = key.num_lights;
+	t.mapping = mapping;
+	t.mapping_size = st.st_size;
+	t.arena.bytes = header->file_size - header->columns_offset;
+	t.arena.mapped = false;
+	
+	const char *base = (const char*) mapping;
+	const uint32_t *stats = (const uint32_t*)(base + header->stats_offset);
+	unpack_stats(stats, t.num_lights, t.red_stats);
+	unpack_stats(stats + STATS_WORDS*t.num_lights, t.num_lights, t.green_stats);
+	unpack_stats(stats + 2*STATS_WORDS*t.num_lights, t.num_lights, t.blue_stats);
+	
+	/* The matrix is only ever read, so the file's columns serve as the arena */
+	point_columns(t, (float*)(base + header->columns_offset), column_stride(pixels));
+	return true;
+}
+
+/*
+Brings the cache at 'path' up to date with the images of 'scene'.
+Lights whose size or modification time changed are hashed, and those whose
+contents really differ are decoded and patched into the mapped columns with
+patch_light_column, which only touches the columns the transform mixes them
+into. Returns false when there is no usable cache or so much changed that a
+full rebuild is cheaper
+*/
+bool refresh_transport_cache(const char *path, const CacheKey &key, const Scene &scene, int num_threads) {
+	int fd = open(path, O_RDWR);
+	if (fd < 0) return false;
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	
+	void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+	
+	char *base = (char*) mapping;
+	CacheHeader *header = (CacheHeader*) mapping;
+	if (!valid_header(header, key, st.st_size)) {
+		munmap(mapping, st.st_size);
+		return false;
+	}
+	
+	const int num_lights = key.num_lights;
+	const size_t pixels = (size_t)key.width * key.height;
+	const size_t stride = column_stride(pixels);
+	FileStamp *manifest = (FileStamp*)(base + header->manifest_offset);
+	
+	/* Only hash the files whose size or modification time moved */
+	vector<int> changed;
+	vector<FileStamp> changed_stamps;
+	for (int i=0; i<num_lights; i++) {
+		const string &filename = scene.files[i];
+		FileStamp stamp = stamp_file(filename, false);
+		if (stamp.size == manifest[i].size && stamp.mtime == manifest[i].mtime)
+			continue;
+		stamp = stamp_file(filename, true);
+		if (stamp.size == manifest[i].size && stamp.hash == manifest[i].hash) {
+			manifest[i].mtime = stamp.mtime;
+			continue;
+		}
+		changed.push_back(i);
+		changed_stamps.push_back(stamp);
+	}
+	
+	if (changed.empty()) {
+		munmap(mapping, st.st_size);
+		return true;
+	}
+	if (changed.size() > (size_t)num_lights / 2) {
+		munmap(mapping, st.st_size);
+		clog << changed.size() << " of " << num_lights << " lights changed, rebuilding " << path << "\n";
+		return false;
+	}
+	
+	if (num_threads > 0) omp_set_num_threads(num_threads);
+	
+	/* Decode the new images */
+	vector<float> values(3*pixels*changed.size());
+	vector<unsigned> errors(changed.size(), 0);
+	#pragma omp parallel for schedule(dynamic)
+	for (int n=0; n<(int)changed.size(); n++) {
+		float *planes = &values[3*pixels*n];
+		errors[n] = load_light(scene, changed[n], key.width, key.height,
+			planes, planes + pixels, planes + 2*pixels);
+	}
+	check_light_errors(errors, key.width, key.height);
+	
+	/* Patch them into each channel */
+	float *columns = (float*)(base + header->columns_offset);
+	uint32_t *stats_words = (uint32_t*)(base + header->stats_offset);
+	vector<float*> cols(num_lights);
+	for (int c=0; c<3; c++) {
+		for (int i=0; i<num_lights; i++)
+			cols[i] = columns + ((size_t)c*num_lights + i)*stride;
+		
+		vector<char> touched(num_lights, 0);
+		for (unsigned int n=0; n<changed.size(); n++) {
+			clog << "Patching light " << changed[n] << " (" << n+1 << " of " << changed.size() << ")\r";
+			patch_light_column(&cols[0], num_lights, pixels, changed[n], scene.wavelet,
+				&values[3*pixels*n + c*pixels], touched);
+		}
+		
+		ColumnStats stats;
+		uint32_t *words = stats_words + c*STATS_WORDS*num_lights;
+		unpack_stats(words, num_lights, stats);
+		for (int i=0; i<num_lights; i++) {
+			if (touched[i])
+				column_stats(cols[i], pixels, stats, i);
+		}
+		pack_stats(stats, words);
+	}
+	clog << "\n";
+	
+	for (unsigned int n=0; n<changed.size(); n++)
+		manifest[changed[n]] = changed_stamps[n];
+	
+	bool ok = msync(mapping, st.st_size, MS_SYNC) == 0;
+	munmap(mapping, st.st_size);
+	clog << "Patched " << changed.size() << " changed lights into " << path << "\n";
+	return ok;
+}
+
+static bool write_padding(FILE *file, uint64_t offset) {
+	static const char zeros[4096] = {0};
+	long pos = ftell(file);
+	return pos >= 0 && fwrite(zeros, 1, offset - pos, file) == offset - pos;
+}
+
+/*
+Writes 't' to 'path'. The file is written next to the destination and renamed
+over it, so an interrupted run never leaves a truncated cache behind
+*/
+bool save_transport_cache(const Transport &t, const char *path, const CacheKey &key,
+	const vector<FileStamp> &stamps) {
+	string tmp_path = string(path) + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file) {
+		clog << "Could not write transport cache " << path << "\n";
+		return false;
+	}
+	
+	CacheHeader header = make_header(key);
+	
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	vector<uint32_t> stats(3*STATS_WORDS*t.num_lights);
+	pack_stats(t.red_stats, &stats[0]);
+	pack_stats(t.green_stats, &stats[STATS_WORDS*t.num_lights]);
+	pack_stats(t.blue_stats, &stats[2*STATS_WORDS*t.num_lights]);
+	ok = ok && write_padding(file, header.stats_offset);
+	ok = ok && fwrite(&stats[0], sizeof(uint32_t), stats.size(), file) == stats.size();
+	ok = ok && write_padding(file, header.manifest_offset);
+	ok = ok && fwrite(&stamps[0], sizeof(FileStamp), t.num_lights, file) == t.num_lights;
+	ok = ok && write_padding(file, header.columns_offset);
+	
+	/* The arena is laid out as the file's columns, padding and all */
+	size_t floats = 3 * t.num_lights * t.arena.stride;
+	ok = ok && fwrite(t.arena.data, sizeof(float), floats, file) == floats;
+	ok = (fclose(file) == 0) && ok;
+	
+	if (!ok || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		clog << "Could not write transport cache " << path << "\n";
+		return false;
+	}
+	clog << "Saved transport cache " << path << "\n";
+	return true;
+}
+
+/* pread/pwrite the whole range, they may transfer less than asked for */
+static bool read_fully(int fd, void *data, size_t size, uint64_t offset) {
+	char *bytes = (char*) data;
+	while (size > 0) {
+		ssize_t n = pread(fd, bytes, size, offset);
+		if (n <= 0) return false;
+		bytes += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool write_fully(int fd, const void *data, size_t size, uint64_t offset) {
+	const char *bytes = (const char*) data;
+	while (size > 0) {
+		ssize_t n = pwrite(fd, bytes, size, offset);
+		if (n <= 0) return false;
+		bytes += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/*
+Builds the cache at 'path' without ever holding the whole matrix in memory.
+The first pass decodes every light straight into its columns in the file.
+The second pass walks the pixels in bands small enough that all the lights'
+values for a band, plus each thread's decode planes, fit in 'memory_budget'
+bytes, wavelet transforms them and writes them back in place, gathering the
+column statistics as it goes. The result can then be mapped by
+load_transport_cache, which lets the OS page it in on demand
+*/
+bool stream_transport_cache(const char *path, const CacheKey &key, const Scene &scene,
+	const vector<FileStamp> &stamps, int num_threads, size_t memory_budget) {
+	
+	string tmp_path = string(path) + ".tmp";
+	int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		clog << "Could not write transport cache " << path << "\n";
+		return false;
+	}
+	
+	CacheHeader header = make_header(key);
+	const unsigned int num_lights = key.num_lights;
+	const size_t pixels = (size_t)key.width * key.height;
+	const size_t column_bytes = column_stride(pixels)*sizeof(float);
+	const uint64_t channel_bytes = (uint64_t)num_lights*column_bytes;
+	
+	bool ok = ftruncate(fd, header.file_size) == 0;
+	ok = ok && write_fully(fd, &header, sizeof(header), 0);
+	ok = ok && write_fully(fd, &stamps[0], num_lights*sizeof(FileStamp), header.manifest_offset);
+	
+	if (num_threads > 0) omp_set_num_threads(num_threads);
+	
+	/* Pass 1: each thread holds one decoded light at a time */
+	vector<unsigned> errors(num_lights, 0);
+	vector<char> write_failed(num_lights, 0);
+	int loaded = 0;
+	if (ok) {
+		#pragma omp parallel
+		{
+			vector<float> planes(3*pixels);
+			#pragma omp for schedule(dynamic)
+			for (int i=0; i<(int)num_lights; i++) {
+				errors[i] = load_light(scene, i, key.width, key.height,
+					&planes[0], &planes[pixels], &planes[2*pixels]);
+				if (!errors[i] || errors[i] == LIGHT_MISSING) {
+					for (int c=0; c<3; c++) {
+						uint64_t offset = header.columns_offset + c*channel_bytes + i*column_bytes;
+						if (!write_fully(fd, &planes[c*pixels], pixels*sizeof(float), offset))
+							write_failed[i] = 1;
+					}
+				}
+				
+				#pragma omp critical
+				{
+					loaded++;
+					clog << "Streaming file " << loaded << " of " << num_lights << "\r";
+				}
+			}
+		}
+		clog << "\n";
+		
+		/* Drop the full size file before a bad light ends the program */
+		for (unsigned int i=0; i<num_lights; i++) {
+			if (errors[i] && errors[i] != LIGHT_MISSING) {
+				close(fd);
+				remove(tmp_path.c_str());
+				break;
+			}
+		}
+		check_light_errors(errors, key.width, key.height);
+		for (unsigned int i=0; i<num_lights; i++)
+			ok = ok && !write_failed[i];
+	}
+	
+	/*
+	Pass 2: one band of pixel rows per channel at a time. The band gets what
+	the budget leaves after the decode planes each thread held in pass 1
+	*/
+	size_t planes_bytes = (size_t)omp_get_max_threads()*3*pixels*sizeof(float);
+	size_t band_budget = memory_budget > planes_bytes ? memory_budget - planes_bytes : 0;
+	size_t band = band_budget / (num_lights*sizeof(float));
+	band = max((size_t)1, min(band, pixels));
+	vector<float> band_values(band*num_lights);
+	vector<float*> band_cols(num_lights);
+	for (unsigned int i=0; i<num_lights; i++)
+		band_cols[i] = &band_values[i*band];
+	vector<uint32_t> stats_words(3*STATS_WORDS*num_lights);
+	StatsAccumulator stats;
+	
+	for (int c=0; c<3 && ok; c++) {
+		uint64_t channel = header.columns_offset + c*channel_bytes;
+		reset_stats(stats, num_lights);
+		for (size_t start=0; start<pixels && ok; start+=band) {
+			size_t count = min(band, pixels - start);
+			clog << "Wavelet transforming channel " << c << " rows " << start << " of " << pixels << "\r";
+			for (unsigned int i=0; i<num_lights && ok; i++)
+				ok = read_fully(fd, band_cols[i], count*sizeof(float), channel + i*column_bytes + start*sizeof(float));
+			if (!ok) break;
+			
+			transform_pixel_rows(&band_cols[0], num_lights, count, scene.wavelet, &stats);
+			
+			for (unsigned int i=0; i<num_lights && ok; i++)
+				ok = write_fully(fd, band_cols[i], count*sizeof(float), channel + i*column_bytes + start*sizeof(float));
+		}
+		
+		ColumnStats channel_stats;
+		finish_stats(stats, channel_stats);
+		pack_stats(channel_stats, &stats_words[c*STATS_WORDS*num_lights]);
+	}
+	clog << "\n";
+	
+	ok = ok && write_fully(fd, &stats_words[0], stats_words.size()*sizeof(uint32_t), header.stats_offset);
+	ok = (close(fd) == 0) && ok;
+	
+	if (!ok || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		clog << "Could not write transport cache " << path << "\n";
+		return false;
+	}
+	clog << "Saved transport cache " << path << "\n";
+	return true;
+}
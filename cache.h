@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <vector>
+
+#include "transport.h"
+
+#ifndef __INCLUDECACHE
+#define __INCLUDECACHE
+
+/*
+On-disk cache of a finished (wavelet-domain) transport matrix.
+The file is a CacheHeader followed by the per-column statistics, a FileStamp for
+every source image and then the red, green and blue columns, each light's
+width*height floats padded to column_stride, exactly as in a ColumnArena.
+It is mapped read-only at startup so no image is decoded or transformed again.
+Lights whose image changed since are patched in place by refresh_transport_cache.
+Bump CACHE_VERSION whenever the layout or the transform changes
+*/
+#define CACHE_VERSION 5
+
+/*
+TRANSFORM_HAAR + WAVELET_* for a wavelet basis, with TRANSFORM_STANDARD set
+for the standard decomposition
+*/
+enum {TRANSFORM_NONE, TRANSFORM_HAAR, TRANSFORM_D4, TRANSFORM_CDF97};
+const uint32_t TRANSFORM_STANDARD = 0x100;
+
+/* Everything a cache has to match to be reused */
+struct CacheKey {
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_lights;
+	uint32_t transform;
+	uint64_t source_hash; /* folder name and the file of every light */
+};
+
+/* Identifies the contents of one source image */
+struct FileStamp {
+	int64_t size;
+	int64_t mtime;
+	uint64_t hash; /* of the file contents */
+};
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	CacheKey key;
+	uint64_t stats_offset;
+	uint64_t manifest_offset;
+	uint64_t columns_offset;
+	uint64_t file_size;
+};
+
+/* Starting value for hash_bytes */
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+uint64_t transport_fingerprint(const Transport &t);
+CacheKey transport_cache_key(const Scene &scene, unsigned int width, unsigned int height);
+std::vector<FileStamp> stamp_light_files(const Scene &scene);
+bool load_transport_cache(Transport &t, const char *path, const CacheKey &key);
+bool refresh_transport_cache(const char *path, const CacheKey &key, const Scene &scene, int num_threads);
+bool save_transport_cache(const Transport &t, const char *path, const CacheKey &key,
+	const std::vector<FileStamp> &stamps);
+bool stream_transport_cache(const char *path, const CacheKey &key, const Scene &scene,
+	const std::vector<FileStamp> &stamps, int num_threads, size_t memory_budget);
+
+#endif
@@ -0,0 +1,376 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include "omp.h"
+
+#include "cpca.h"
+
+using namespace std;
+
+static const char CPCA_MAGIC[8] = {'P','R','T','C','P','C','A','\0'};
+static const uint32_t CPCA_VERSION = 1;
+
+/* Pixels whose products with the clusters are accumulated together */
+static const int CPCA_BLOCK = 256;
+
+/*
+Side file next to the transport cache. The fingerprint changes when a light
+is patched into the cache, which invalidates it
+*/
+struct CPCAHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t clusters;
+	uint32_t basis;
+	uint32_t padding;
+	CacheKey key;
+	uint64_t fingerprint;
+};
+
+/*
+Seeds the clusters with the rows at evenly spaced quantiles of the row norm,
+which spreads them from the unlit background to the brightest pixels.
+'means' is light major, means[i*clusters + k]
+*/
+static void seed_clusters(float **cols, unsigned int num_lights, size_t pixels,
+	int clusters, vector<float> &means) {
+	vector< pair<float,uint32_t> > norms(pixels);
+	for (size_t p=0; p<pixels; p++) norms[p] = make_pair(0.0f, (uint32_t)p);
+	for (unsigned int i=0; i<num_lights; i++)
+		for (size_t p=0; p<pixels; p++)
+			norms[p].first += cols[i][p]*cols[i][p];
+	sort(norms.begin(), norms.end());
+	
+	means.resize((size_t)num_lights * clusters);
+	for (int k=0; k<clusters; k++) {
+		uint32_t seed = norms[(size_t)((k + 0.5) * pixels / clusters)].second;
+		for (unsigned int i=0; i<num_lights; i++)
+			means[(size_t)i*clusters + k] = cols[i][seed];
+	}
+}
+
+/*
+Assigns the pixel rows of every 'step'th block to the nearest mean. The dot
+products with all the means are accumulated a block of pixels at a time
+while walking the columns
+*/
+static void assign_clusters(float **cols, unsigned int num_lights, size_t pixels,
+	int clusters, const vector<float> &means, int step, vector<uint32_t> &cluster) {
+	vector<float> mean_norms(clusters, 0.0f);
+	for (unsigned int i=0; i<num_lights; i++)
+		for (int k=0; k<clusters; k++)
+			mean_norms[k] += means[(size_t)i*clusters + k] * means[(size_t)i*clusters + k];
+	
+	const int blocks = (pixels + CPCA_BLOCK - 1) / CPCA_BLOCK;
+	#pragma omp parallel
+	{
+		vector<float> dots(CPCA_BLOCK * clusters);
+		#pragma omp for schedule(static)
+		for (int b=0; b<blocks; b+=step) {
+			size_t p0 = (size_t)b * CPCA_BLOCK;
+			int width = min((size_t)CPCA_BLOCK, pixels - p0);
+			fill(dots.begin(), dots.end(), 0.0f);
+			for (unsigned int i=0; i<num_lights; i++) {
+				const float *col = cols[i] + p0;
+				const float *m = &means[(size_t)i*clusters];
+				for (int p=0; p<width; p++) {
+					float x = col[p];
+					if (x == 0.0f) continue;
+					float *d = &dots[p*clusters];
+					for (int k=0; k<clusters; k++) d[k] += x * m[k];
+				}
+			}
+			for (int p=0; p<width; p++) {
+				int best = 0;
+				float best_distance = FLT_MAX;
+				for (int k=0; k<clusters; k++) {
+					float distance = mean_norms[k] - 2.0f*dots[p*clusters + k];
+					if (distance < best_distance) {
+						best_distance = distance;
+						best = k;
+					}
+				}
+				cluster[p0 + p] = best;
+			}
+		}
+	}
+}
+
+/*
+Recomputes the mean of every cluster, keeping the old one if it emptied.
+Pixels in cluster 'clusters' have not been assigned and are skipped
+*/
+static void update_means(float **cols, unsigned int num_lights, size_t pixels,
+	int clusters, const vector<uint32_t> &cluster, vector<float> &means) {
+	vector<uint32_t> counts(clusters + 1, 0);
+	for (size_t p=0; p<pixels; p++) counts[cluster[p]]++;
+	
+	#pragma omp parallel
+	{
+		vector<double> sums(clusters + 1);
+		#pragma omp for schedule(static)
+		for (int i=0; i<(int)num_lights; i++) {
+			fill(sums.begin(), sums.end(), 0.0);
+			for (size_t p=0; p<pixels; p++)
+				sums[cluster[p]] += cols[i][p];
+			for (int k=0; k<clusters; k++) {
+				if (counts[k])
+					means[(size_t)i*clusters + k] = sums[k] / counts[k];
+			}
+		}
+	}
+}
+
+/*
+Orthonormalizes the basis vectors of every cluster by Gram-Schmidt. 'vectors'
+is light major, vectors[(i*clusters + k)*basis + j]
+*/
+static void orthonormalize(vector<float> &vectors, unsigned int num_lights, int clusters, int basis) {
+	#pragma omp parallel for schedule(static)
+	for (int k=0; k<clusters; k++) {
+		for (int j=0; j<basis; j++) {
+			for (int l=0; l<j; l++) {
+				double dot = 0.0;
+				for (unsigned int i=0; i<num_lights; i++) {
+					const float *v = &vectors[((size_t)i*clusters + k)*basis];
+					dot += (double)v[j] * v[l];
+				}
+				for (unsigned int i=0; i<num_lights; i++) {
+					float *v = &vectors[((size_t)i*clusters + k)*basis];
+					v[j] -= dot * v[l];
+				}
+			}
+			double norm = 0.0;
+			for (unsigned int i=0; i<num_lights; i++) {
+				float v = vectors[((size_t)i*clusters + k)*basis + j];
+				norm += (double)v * v;
+			}
+			float scale = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0f;
+			for (unsigned int i=0; i<num_lights; i++)
+				vectors[((size_t)i*clusters + k)*basis + j] *= scale;
+		}
+	}
+}
+
+/*
+Projects every centered pixel row onto its cluster's basis vectors,
+weights[p*basis + j]. Returns the squared length of the centered rows in
+'centered' so the caller can tell how much the projection misses
+*/
+static void project_rows(float **cols, unsigned int num_lights, size_t pixels, int clusters,
+	int basis, const vector<uint32_t> &cluster, const vector<float> &means,
+	const vector<float> &vectors, vector<float> &weights, double *centered) {
+	const int blocks = (pixels + CPCA_BLOCK - 1) / CPCA_BLOCK;
+	double total = 0.0;
+	#pragma omp parallel for schedule(static) reduction(+:total)
+	for (int b=0; b<blocks; b++) {
+		size_t p0 = (size_t)b * CPCA_BLOCK;
+		int width = min((size_t)CPCA_BLOCK, pixels - p0);
+		/* With no basis vectors only the centered length is measured */
+		float *w = basis ? &weights[p0*basis] : NULL;
+		fill(w, w + width*basis, 0.0f);
+		for (unsigned int i=0; i<num_lights; i++) {
+			const float *col = cols[i] + p0;
+			const float *m = &means[(size_t)i*clusters];
+			const float *v = basis ? &vectors[(size_t)i*clusters*basis] : NULL;
+			for (int p=0; p<width; p++) {
+				uint32_t k = cluster[p0 + p];
+				float x = col[p] - m[k];
+				total += (double)x * x;
+				for (int j=0; j<basis; j++)
+					w[p*basis + j] += x * v[k*basis + j];
+			}
+		}
+	}
+	if (centered) *centered = total;
+}
+
+/*
+One step of subspace iteration for every cluster at once,
+vectors = (X - M) (X - M)^T vectors through the current weights
+*/
+static void power_step(float **cols, unsigned int num_lights, size_t pixels, int clusters,
+	int basis, const vector<uint32_t> &cluster, const vector<float> &means,
+	const vector<float> &weights, vector<float> &vectors) {
+	#pragma omp parallel for schedule(static)
+	for (int i=0; i<(int)num_lights; i++) {
+		const float *m = &means[(size_t)i*clusters];
+		float *v = &vectors[(size_t)i*clusters*basis];
+		fill(v, v + clusters*basis, 0.0f);
+		for (size_t p=0; p<pixels; p++) {
+			uint32_t k = cluster[p];
+			float x = cols[i][p] - m[k];
+			if (x == 0.0f) continue;
+			for (int j=0; j<basis; j++)
+				v[k*basis + j] += x * weights[p*basis + j];
+		}
+	}
+}
+
+/* Clusters and compresses one channel, returning the squared error left */
+static double compress_channel(float **cols, unsigned int num_lights, size_t pixels,
+	int clusters, int basis, CPCAChannel &out) {
+	out.clusters = clusters;
+	out.basis = basis;
+	out.num_lights = num_lights;
+	out.pixels = pixels;
+	out.cluster.assign(pixels, clusters);
+	
+	vector<float> means;
+	seed_clusters(cols, num_lights, pixels, clusters, means);
+	for (int n=0; n<CPCA_KMEANS_ITERATIONS; n++) {
+		assign_clusters(cols, num_lights, pixels, clusters, means, CPCA_SAMPLE, out.cluster);
+		update_means(cols, num_lights, pixels, clusters, out.cluster, means);
+	}
+	assign_clusters(cols, num_lights, pixels, clusters, means, 1, out.cluster);
+	update_means(cols, num_lights, pixels, clusters, out.cluster, means);
+	
+	/* Start from a fixed pseudo random basis so the result is repeatable */
+	vector<float> vectors((size_t)num_lights * clusters * basis);
+	uint32_t state = 12345;
+	for (size_t n=0; n<vectors.size(); n++) {
+		state = state * 1664525u + 1013904223u;
+		vectors[n] = (state >> 8) * (1.0f / (1 << 24)) - 0.5f;
+	}
+	orthonormalize(vectors, num_lights, clusters, basis);
+	
+	out.weights.resize(pixels * basis);
+	for (int n=0; n<CPCA_POWER_ITERATIONS && basis > 0; n++) {
+		project_rows(cols, num_lights, pixels, clusters, basis, out.cluster, means, vectors,
+			out.weights, NULL);
+		power_step(cols, num_lights, pixels, clusters, basis, out.cluster, means, out.weights, vectors);
+		orthonormalize(vectors, num_lights, clusters, basis);
+	}
+	double centered;
+	project_rows(cols, num_lights, pixels, clusters, basis, out.cluster, means, vectors,
+		out.weights, &centered);
+	
+	/* With an orthonormal basis the error is what the weights do not capture */
+	double captured = 0.0;
+	for (size_t n=0; n<out.weights.size(); n++)
+		captured += (double)out.weights[n] * out.weights[n];
+	
+	out.vectors.resize((size_t)num_lights * clusters * (basis + 1));
+	for (unsigned int i=0; i<num_lights; i++) {
+		for (int k=0; k<clusters; k++) {
+			float *v = &out.vectors[((size_t)i*clusters + k)*(basis + 1)];
+			v[0] = means[(size_t)i*clusters + k];
+			for (int j=0; j<basis; j++)
+				v[1 + j] = vectors[((size_t)i*clusters + k)*basis + j];
+		}
+	}
+	return max(0.0, centered - captured);
+}
+
+/*
+Compresses every channel of the dense (wavelet domain) columns of 't' into
+'clusters' clusters of 'basis' vectors each, and reports the size and the
+relative error of the approximation
+*/
+void build_cpca(const Transport &t, int clusters, int basis,
+	CPCAChannel &red, CPCAChannel &green, CPCAChannel &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	float **cols[3] = {t.red, t.green, t.blue};
+	const ColumnStats *stats[3] = {&t.red_stats, &t.green_stats, &t.blue_stats};
+	CPCAChannel *out[3] = {&red, &green, &blue};
+	
+	double error = 0.0, energy = 0.0;
+	for (int c=0; c<3; c++) {
+		clog << "Clustered PCA of channel " << c << " (" << clusters << " clusters, "
+			<< basis << " vectors)\r";
+		error += compress_channel(cols[c], t.num_lights, pixels, clusters, basis, *out[c]);
+		for (unsigned int i=0; i<t.num_lights; i++)
+			energy += (double)stats[c]->norm[i] * stats[c]->norm[i];
+	}
+	clog << "\n";
+	
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double cpca_bytes = 3.0 * (red.vectors.size() + red.weights.size()) * sizeof(float)
+		+ 3.0 * pixels * sizeof(uint32_t);
+	clog << "Clustered PCA is " << cpca_bytes / (1 << 20) << " MB instead of "
+		<< dense_bytes / (1 << 20) << " MB, relative error "
+		<< sqrt(error / max(energy, 1e-30)) << "\n";
+}
+
+static CPCAHeader make_header(const Transport &t, const CacheKey &key, int clusters, int basis) {
+	CPCAHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CPCA_MAGIC, sizeof(CPCA_MAGIC));
+	header.version = CPCA_VERSION;
+	header.clusters = clusters;
+	header.basis = basis;
+	header.key = key;
+	header.fingerprint = transport_fingerprint(t);
+	return header;
+}
+
+/* Both are empty when there are no basis vectors */
+template <typename T>
+static bool read_vector(FILE *file, vector<T> &v, size_t count) {
+	v.resize(count);
+	return count == 0 || fread(&v[0], sizeof(T), count, file) == count;
+}
+
+template <typename T>
+static bool write_vector(FILE *file, const vector<T> &v) {
+	return v.empty() || fwrite(&v[0], sizeof(T), v.size(), file) == v.size();
+}
+
+/* Reads the compression at 'path' if it was made from this transport with these settings */
+bool load_cpca(const char *path, const Transport &t, const CacheKey &key, int clusters, int basis,
+	CPCAChannel &red, CPCAChannel &green, CPCAChannel &blue) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+	
+	CPCAHeader header, expected = make_header(t, key, clusters, basis);
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(&header, &expected, sizeof(header)) == 0;
+	
+	size_t pixels = (size_t)t.width * t.height;
+	CPCAChannel *out[3] = {&red, &green, &blue};
+	for (int c=0; c<3 && ok; c++) {
+		out[c]->clusters = clusters;
+		out[c]->basis = basis;
+		out[c]->num_lights = t.num_lights;
+		out[c]->pixels = pixels;
+		ok = read_vector(file, out[c]->cluster, pixels)
+			&& read_vector(file, out[c]->vectors, (size_t)t.num_lights * clusters * (basis + 1))
+			&& read_vector(file, out[c]->weights, pixels * basis);
+	}
+	fclose(file);
+	return ok;
+}
+
+/* Writes the compression next to the transport cache, through a temporary file */
+bool save_cpca(const char *path, const Transport &t, const CacheKey &key,
+	const CPCAChannel &red, const CPCAChannel &green, const CPCAChannel &blue) {
+	string tmp_path = string(path) + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file) {
+		clog << "Could not write " << path << "\n";
+		return false;
+	}
+	
+	CPCAHeader header = make_header(t, key, red.clusters, red.basis);
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	const CPCAChannel *channels[3] = {&red, &green, &blue};
+	for (int c=0; c<3 && ok; c++) {
+		const CPCAChannel &ch = *channels[c];
+		ok = write_vector(file, ch.cluster) && write_vector(file, ch.vectors)
+			&& write_vector(file, ch.weights);
+	}
+	ok = (fclose(file) == 0) && ok;
+	
+	if (!ok || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		clog << "Could not write " << path << "\n";
+		return false;
+	}
+	clog << "Saved clustered PCA " << path << "\n";
+	return true;
+}
@@ -0,0 +1,43 @@
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "transport.h"
+#include "cache.h"
+
+#ifndef __INCLUDECPCA
+#define __INCLUDECPCA
+
+/*
+Clustered PCA of one channel's pixel rows (Sloan et al. 2003). Pixel p lies in
+cluster[p] and its row over the lights is approximated by the cluster mean plus
+weights[p*basis + j] times the cluster's basis vector j. The means and vectors
+are stored light major: entry (basis+1)*(k + clusters*i) is the mean of
+cluster k at light i, followed by its basis vectors at that light
+*/
+struct CPCAChannel {
+	unsigned int clusters;
+	unsigned int basis;
+	unsigned int num_lights;
+	size_t pixels;
+	std::vector<uint32_t> cluster;
+	std::vector<float> vectors;
+	std::vector<float> weights;
+};
+
+/*
+k-means and subspace iteration steps used by build_cpca. The k-means steps
+only look at every CPCA_SAMPLE'th block of pixels, before one full assignment
+*/
+const int CPCA_KMEANS_ITERATIONS = 8;
+const int CPCA_POWER_ITERATIONS = 6;
+const int CPCA_SAMPLE = 8;
+
+void build_cpca(const Transport &t, int clusters, int basis,
+	CPCAChannel &red, CPCAChannel &green, CPCAChannel &blue);
+bool load_cpca(const char *path, const Transport &t, const CacheKey &key, int clusters, int basis,
+	CPCAChannel &red, CPCAChannel &green, CPCAChannel &blue);
+bool save_cpca(const char *path, const Transport &t, const CacheKey &key,
+	const CPCAChannel &red, const CPCAChannel &green, const CPCAChannel &blue);
+
+#endif
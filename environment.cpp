@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include "environment.h"
+#include "lodepng.h"
+#include "wavelet.h"
+
+using namespace std;
+
+/*
+Loads the six faces of environment_maps/'folder' and box filters them down to
+'env_resolution' texels per side, appending them face after face
+*/
+void load_environment_map(const char *folder, unsigned int env_resolution,
+	vector<float> &red_env, vector<float> &green_env, vector<float> &blue_env) {
+	red_env.clear();
+	green_env.clear();
+	blue_env.clear();
+	
+	unsigned int NUM_FACES = 6;
+	unsigned int resolution;
+	
+	vector<unsigned char> image; //the raw pixels
+	
+	vector<float> red_env_face;
+	vector<float> green_env_face;
+	vector<float> blue_env_face;
+	
+	for (unsigned int i=0; i<NUM_FACES; i++) {
+		char filename[256];
+		snprintf(filename, sizeof(filename), "environment_maps/%s/%s%d.png", folder, folder, i);
+		
+		lodepng::decode(image, resolution, resolution, filename);
+
+		for(unsigned int j=0; j<image.size(); j+=4) {
+			red_env_face.push_back(image[j]/255.0f);
+			green_env_face.push_back(image[j+1]/255.0f);
+			blue_env_face.push_back(image[j+2]/255.0f);
+		}
+		image.clear();
+		
+		/* Downsample to desired resolution */
+		vector<float> new_red;
+		vector<float> new_green;
+		vector<float> new_blue;
+		while (resolution > env_resolution) {
+			resolution /= 2;
+			for (unsigned int y=0; y<resolution; y++) {
+				for (unsigned int x=0; x<resolution; x++){
+					int p0 = 2*x + 4*y*resolution;
+					int p1 = p0 + 1;
+					int p2 = p0 + 2*resolution;
+					int p3 = p0 + 2*resolution + 1;
+
+					float ave;
+					ave = red_env_face[p0] + red_env_face[p1] + red_env_face[p2] + red_env_face[p3];
+					ave /= 4.0f;
+					new_red.push_back(ave);
+					ave = green_env_face[p0] + green_env_face[p1] + green_env_face[p2] + green_env_face[p3];
+					ave /= 4.0f;
+					new_green.push_back(ave);
+					ave = blue_env_face[p0] + blue_env_face[p1] + blue_env_face[p2] + blue_env_face[p3];
+					ave /= 4.0f;
+					new_blue.push_back(ave);
+				}
+			}
+			red_env_face = new_red;
+			green_env_face = new_green;
+			blue_env_face = new_blue;
+			new_red.clear();
+			new_green.clear();
+			new_blue.clear();	
+		}
+		
+		/*Insert this side of cubemap into envirornmap vector */
+		red_env.insert(red_env.end(),red_env_face.begin(),red_env_face.end());
+		green_env.insert(green_env.end(),green_env_face.begin(),green_env_face.end());
+		blue_env.insert(blue_env.end(),blue_env_face.begin(),blue_env_face.end());
+		red_env_face.clear();
+		green_env_face.clear();
+		blue_env_face.clear();
+	}
+}
+
+/* Fills in the coefficients of shift 'shift', rows forward, modulo the rows */
+static void transform_shift(ShiftedCoefficients &coeffs, int shift) {
+	vector<float> &out = coeffs.shifted[shift];
+	out.resize(coeffs.base.size());
+	rotate_copy(coeffs.base.begin(), coeffs.base.begin() + shift*coeffs.resolution,
+		coeffs.base.end(), out.begin());
+	#ifdef USEHAAR
+	vector<float> scratch;
+	wavelet2d(out, coeffs.wavelet, WAVELET_FORWARD, scratch);
+	#endif
+}
+
+/*
+Small environments have every shift transformed up front, so even the first
+sweep of the arrow keys is a lookup. Past ENV_PRECOMPUTE_FLOATS the 36*res^3
+floats of all shifts are not worth holding, and each shift is transformed the
+first time it is reached instead
+*/
+void reset_shifted_coefficients(ShiftedCoefficients &coeffs, const vector<float> &env,
+	unsigned int resolution, const Wavelet &wavelet) {
+	coeffs.resolution = resolution;
+	coeffs.wavelet = wavelet;
+	coeffs.base = env;
+	coeffs.shifted.assign(env.size() / resolution, vector<float>());
+	
+	if (coeffs.shifted.size() * env.size() <= ENV_PRECOMPUTE_FLOATS) {
+		for (unsigned int shift=0; shift<coeffs.shifted.size(); shift++)
+			transform_shift(coeffs, shift);
+	}
+}
+
+/*
+Coefficients of the channel after it has been shifted 'rows' rows forward,
+as shift_env_map does. Negative shifts wrap around
+*/
+const vector<float>& shifted_coefficients(ShiftedCoefficients &coeffs, int rows) {
+	int total_rows = coeffs.shifted.size();
+	int shift = ((rows % total_rows) + total_rows) % total_rows;
+	if (coeffs.shifted[shift].empty())
+		transform_shift(coeffs, shift);
+	return coeffs.shifted[shift];
+}
@@ -0,0 +1,31 @@
+#include <cstddef>
+#include <vector>
+
+#include "wavelet.h"
+
+#ifndef __INCLUDEENVIRONMENT
+#define __INCLUDEENVIRONMENT
+
+/* Largest total size, in floats, of the shifts transformed up front (4 MB) */
+const size_t ENV_PRECOMPUTE_FLOATS = 1 << 20;
+
+/*
+Wavelet coefficients of one environment channel under each row shift.
+shift_env_map moves whole rows through the stacked faces, so there are only
+6*res distinct environments. Each one is transformed once and looked up
+after that
+*/
+struct ShiftedCoefficients {
+	unsigned int resolution;
+	Wavelet wavelet;
+	std::vector<float> base;                    /* the unshifted channel */
+	std::vector< std::vector<float> > shifted;  /* per shift, empty until used */
+};
+
+void load_environment_map(const char *folder, unsigned int env_resolution,
+	std::vector<float> &red_env, std::vector<float> &green_env, std::vector<float> &blue_env);
+void reset_shifted_coefficients(ShiftedCoefficients &coeffs, const std::vector<float> &env,
+	unsigned int resolution, const Wavelet &wavelet);
+const std::vector<float>& shifted_coefficients(ShiftedCoefficients &coeffs, int rows);
+
+#endif
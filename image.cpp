@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "lodepng.h"
+
+/*
+Splits 'count' interleaved 8-bit pixels of CHANNELS bytes into float planes.
+The channel count is a template argument so the loop body is branch free and
+the compiler can vectorize the loads and the int to float scaling
+*/
+template <int CHANNELS>
+static void to_planar(const unsigned char *__restrict in, size_t count,
+	float *__restrict red, float *__restrict green, float *__restrict blue) {
+	const float scale = 1.0f / 255.0f;
+	for (size_t j=0; j<count; j++) {
+		red[j] = in[CHANNELS*j] * scale;
+		green[j] = in[CHANNELS*j+1] * scale;
+		blue[j] = in[CHANNELS*j+2] * scale;
+	}
+}
+
+/*
+Decodes the PNG 'filename' into the caller's width*height planes. lodepng
+still decodes into its own 8-bit buffer, which is then split into the planes.
+8-bit RGB and RGBA images are decoded in their own color type, so lodepng
+never expands them to RGBA, everything else is converted to 8-bit RGB.
+Returns a lodepng error code or SIZE_MISMATCH
+*/
+unsigned decode_png_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue) {
+	unsigned char *file = NULL;
+	size_t file_size = 0;
+	unsigned error = lodepng_load_file(&file, &file_size, filename);
+	if (error) {
+		free(file);
+		return error;
+	}
+	
+	LodePNGState state;
+	lodepng_state_init(&state);
+	
+	unsigned int w, h;
+	error = lodepng_inspect(&w, &h, &state, file, file_size);
+	if (!error && (w != width || h != height)) error = SIZE_MISMATCH;
+	
+	unsigned char *pixels = NULL;
+	if (!error) {
+		const LodePNGColorMode &color = state.info_png.color;
+		bool native = color.bitdepth == 8
+			&& (color.colortype == LCT_RGB || color.colortype == LCT_RGBA);
+		state.info_raw.colortype = native ? color.colortype : LCT_RGB;
+		state.info_raw.bitdepth = 8;
+		error = lodepng_decode(&pixels, &w, &h, &state, file, file_size);
+	}
+	
+	if (!error) {
+		if (state.info_raw.colortype == LCT_RGBA)
+			to_planar<4>(pixels, (size_t)w*h, red, green, blue);
+		else
+			to_planar<3>(pixels, (size_t)w*h, red, green, blue);
+	}
+	
+	free(pixels);
+	free(file);
+	lodepng_state_cleanup(&state);
+	return error;
+}
+
+/* Read-only mapping of a whole file, released when it goes out of scope */
+struct MappedFile {
+	const unsigned char *data;
+	size_t size;
+	
+	MappedFile(const char *filename) : data(NULL), size(0) {
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+				data = (const unsigned char*) mapping;
+				size = st.st_size;
+			}
+		}
+		close(fd);
+	}
+	~MappedFile() {
+		if (data) munmap((void*) data, size);
+	}
+};
+
+static bool host_is_little_endian() {
+	const uint32_t one = 1;
+	return *(const unsigned char*) &one == 1;
+}
+
+static float swap_float(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+	memcpy(&value, &bits, sizeof(bits));
+	return value;
+}
+
+/*
+Splits interleaved float pixels with 'channels' floats each into the planes.
+Greyscale images go to all three planes. 'flip' reverses the row order, PFM
+stores the bottom row first
+*/
+static void floats_to_planar(const unsigned char *in, int channels, bool swap, bool flip,
+	unsigned int width, unsigned int height, float *red, float *green, float *blue) {
+	for (unsigned int y=0; y<height; y++) {
+		const unsigned char *row = in + (size_t)(flip ? height - 1 - y : y) * width * channels * sizeof(float);
+		size_t out = (size_t)y * width;
+		for (unsigned int x=0; x<width; x++) {
+			float pixel[3];
+			memcpy(pixel, row + x*channels*sizeof(float), channels*sizeof(float));
+			if (swap) {
+				for (int c=0; c<channels; c++) pixel[c] = swap_float(pixel[c]);
+			}
+			red[out + x] = pixel[0];
+			green[out + x] = pixel[channels == 3 ? 1 : 0];
+			blue[out + x] = pixel[channels == 3 ? 2 : 0];
+		}
+	}
+}
+
+/*
+Memory maps the Portable Float Map 'filename' and copies it into the planes.
+Both color (PF) and greyscale (Pf) maps of either byte order are accepted
+*/
+unsigned decode_pfm_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue) {
+	MappedFile file(filename);
+	if (!file.data) return FLOAT_IMAGE_UNREADABLE;
+	
+	/* The header is three whitespace separated text fields after the magic */
+	char header[128];
+	size_t header_size = file.size < sizeof(header) - 1 ? file.size : sizeof(header) - 1;
+	memcpy(header, file.data, header_size);
+	header[header_size] = 0;
+	
+	char magic[3];
+	unsigned int w, h;
+	float scale;
+	int data_offset = 0;
+	if (sscanf(header, "%2s %u %u %f%n", magic, &w, &h, &scale, &data_offset) != 4
+		|| (strcmp(magic, "PF") != 0 && strcmp(magic, "Pf") != 0) || scale == 0.0f)
+		return FLOAT_IMAGE_MALFORMED;
+	data_offset++; /* the single whitespace character ending the header */
+	
+	if (w != width || h != height) return SIZE_MISMATCH;
+	
+	int channels = magic[1] == 'F' ? 3 : 1;
+	if (file.size < data_offset + (size_t)w*h*channels*sizeof(float))
+		return FLOAT_IMAGE_MALFORMED;
+	
+	bool little_endian = scale < 0.0f;
+	floats_to_planar(file.data + data_offset, channels, little_endian != host_is_little_endian(),
+		true, width, height, red, green, blue);
+	return 0;
+}
+
+/*
+Memory maps 'filename', a headerless image of width*height little-endian
+float RGB pixels stored top row first, and copies it into the planes
+*/
+unsigned decode_raw_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue) {
+	MappedFile file(filename);
+	if (!file.data) return FLOAT_IMAGE_UNREADABLE;
+	if (file.size != (size_t)width*height*3*sizeof(float)) return SIZE_MISMATCH;
+	
+	floats_to_planar(file.data, 3, !host_is_little_endian(), false, width, height, red, green, blue);
+	return 0;
+}
+
+static bool has_extension(const char *filename, const char *extension) {
+	size_t length = strlen(filename), extension_length = strlen(extension);
+	return length >= extension_length
+		&& strcasecmp(filename + length - extension_length, extension) == 0;
+}
+
+/* Picks the decoder from the file extension, PNG unless it is .pfm or .raw */
+unsigned decode_image_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue) {
+	if (has_extension(filename, ".pfm"))
+		return decode_pfm_planar(filename, width, height, red, green, blue);
+	if (has_extension(filename, ".raw"))
+		return decode_raw_planar(filename, width, height, red, green, blue);
+	return decode_png_planar(filename, width, height, red, green, blue);
+}
+
+const char *image_error_text(unsigned error) {
+	switch (error) {
+		case SIZE_MISMATCH: return "image has the wrong size";
+		case FLOAT_IMAGE_UNREADABLE: return "could not map float image";
+		case FLOAT_IMAGE_MALFORMED: return "malformed PFM header or truncated data";
+		default: return lodepng_error_text(error);
+	}
+}
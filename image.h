@@ -0,0 +1,22 @@
+#include <cstddef>
+
+#ifndef __INCLUDEIMAGE
+#define __INCLUDEIMAGE
+
+/* Returned by the decoders when an image is not the expected width x height */
+const unsigned SIZE_MISMATCH = 1000;
+/* Returned by the float image decoders for unreadable or malformed files */
+const unsigned FLOAT_IMAGE_UNREADABLE = 1002;
+const unsigned FLOAT_IMAGE_MALFORMED = 1003;
+
+unsigned decode_png_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue);
+unsigned decode_pfm_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue);
+unsigned decode_raw_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue);
+unsigned decode_image_planar(const char *filename, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue);
+const char *image_error_text(unsigned error);
+
+#endif
@@ -0,0 +1,40 @@
+#include <iostream>
+#include <algorithm>
+#include "omp.h"
+
+#include "interleaved.h"
+
+using namespace std;
+
+/*
+Weaves the dense columns of 't' into one RGB column per light. With 'release'
+the dense columns are given back INTERLEAVE_LIGHTS lights at a time, so the
+copy never needs a second full transport; they read as zero afterwards
+*/
+void build_interleaved_columns(Transport &t, bool release, InterleavedColumns &out) {
+	clog << "Interleaving transport channels\n";
+	out.pixels = (size_t)t.width * t.height;
+	allocate_arena(out.arena, 3*out.pixels, t.num_lights);
+	
+	for (unsigned int first=0; first<t.num_lights; first+=INTERLEAVE_LIGHTS) {
+		unsigned int count = min((unsigned int)INTERLEAVE_LIGHTS, t.num_lights - first);
+		#pragma omp parallel for schedule(static)
+		for (int i=first; i<(int)(first + count); i++) {
+			float *dst = out.arena.data + i*out.arena.stride;
+			const float *r = t.red[i], *g = t.green[i], *b = t.blue[i];
+			for (size_t p=0; p<out.pixels; p++) {
+				dst[3*p] = r[p];
+				dst[3*p+1] = g[p];
+				dst[3*p+2] = b[p];
+			}
+			for (size_t k=3*out.pixels; k<out.arena.stride; k++)
+				dst[k] = 0.0f;
+		}
+		for (int c=0; c<3 && release; c++)
+			release_column_pages(t, c, first, count);
+	}
+}
+
+void free_interleaved_columns(InterleavedColumns &cols) {
+	free_arena(cols.arena);
+}
@@ -0,0 +1,24 @@
+#include <cstddef>
+
+#include "transport.h"
+
+#ifndef __INCLUDEINTERLEAVED
+#define __INCLUDEINTERLEAVED
+
+/*
+Every light's red, green and blue columns woven into one RGB arena column laid
+out like the relit image: light i, pixel p, channel c is
+arena.data[i*arena.stride + 3*p + c]
+*/
+struct InterleavedColumns {
+	size_t pixels;
+	ColumnArena arena;
+};
+
+/* Lights woven between releases of their dense columns */
+const int INTERLEAVE_LIGHTS = 64;
+
+void build_interleaved_columns(Transport &t, bool release, InterleavedColumns &out);
+void free_interleaved_columns(InterleavedColumns &cols);
+
+#endif
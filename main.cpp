@@ -4,21 +4,32 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <glob.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
 #include "omp.h"
 #include <GLUT/glut.h>
 
 #include "shaders.h"
 #include "lodepng.h"
+#include "wavelet.h"
+#include "transport.h"
+#include "cache.h"
+#include "scene.h"
+#include "sparse.h"
+#include "quantize.h"
+#include "cpca.h"
+#include "svd.h"
+#include "relight.h"
+#include "environment.h"
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/epsilon.hpp>
 
-/* Define this if you want to use haar transform */
-#define USEHAAR
-
 typedef glm::vec3 vec3;
 
 using namespace std;
@@ -32,10 +43,20 @@ char* scenefolder = "scenes/tree";
 int env_move_rate;
 int num_wavelets = 150;
 int scene_resolution = 256;
-
-/* used for counting files in directory */
-glob_t gl;
-size_t numSceneFiles = 0;
+int num_threads = 0; /* 0 lets openMP pick one thread per core */
+string cachefile; /* defaults to transport.cache in the scene folder */
+bool use_cache = true;
+size_t memory_budget = 0; /* bytes, 0 means half of physical memory */
+int top_k = 64; /* coefficients kept per pixel row with -s rows */
+float epsilon = 0.0f; /* smallest coefficient kept with -s rows or cols */
+int cpca_clusters = 64; /* clusters with -s cpca */
+int cpca_basis = 8; /* basis vectors per cluster with -s cpca */
+int svd_rank = 32; /* singular vectors kept with -s svd */
+int basis_option = -1; /* basis from -w, -1 keeps the scene's */
+int decomposition_option = -1; /* from -d, -1 keeps the scene's */
+
+/* Which image lights each column of the transport */
+Scene scene;
 
 /* Shaders */
 GLuint vertexshader;
@@ -44,19 +65,35 @@ GLuint shaderprogram;
 GLuint texture;
 
 
-/*
-Light transport matricies for each color channel
-The array indexes the columns
-*/
-vector<float>* red_matrix;
-vector<float>* green_matrix;
-vector<float>* blue_matrix;
-
-/* Average Intensity of each picture (after haar) */
-vector<float> red_means;
-vector<float> green_means;
-vector<float> blue_means;
-enum {NAIVE, WEIGHTED};
+/* Light transport matricies and column means for each color channel */
+Transport transport;
+
+/* How the transport is stored for relighting */
+enum {DENSE, SPARSE_ROWS, SPARSE_COLUMNS, QUANTIZED_8, QUANTIZED_16, HALF, CPCA, LOW_RANK, TILED, INTERLEAVED};
+int storage = DENSE;
+SparseRows red_rows;
+SparseRows green_rows;
+SparseRows blue_rows;
+SparseColumns red_cols;
+SparseColumns green_cols;
+SparseColumns blue_cols;
+QuantizedColumns red_quant;
+QuantizedColumns green_quant;
+QuantizedColumns blue_quant;
+HalfColumns red_half;
+HalfColumns green_half;
+HalfColumns blue_half;
+CPCAChannel red_cpca;
+CPCAChannel green_cpca;
+CPCAChannel blue_cpca;
+LowRankChannel red_svd;
+LowRankChannel green_svd;
+LowRankChannel blue_svd;
+TiledChannel red_tiles;
+TiledChannel green_tiles;
+TiledChannel blue_tiles;
+InterleavedColumns rgb_cols;
+enum {NAIVE, WEIGHTED, ENERGY, SHARED};
 int sort_mode = NAIVE;
 
 /*
@@ -67,209 +104,28 @@ vector<float> red_env;
 vector<float> green_env;
 vector<float> blue_env;
 
-vector< pair<int,float> > red_lights;
-vector< pair<int,float> > green_lights;
-vector< pair<int,float> > blue_lights;
+/* Its wavelet coefficients under each shift, and the current shift in rows */
+ShiftedCoefficients red_coeffs;
+ShiftedCoefficients green_coeffs;
+ShiftedCoefficients blue_coeffs;
+int env_shift = 0;
 
+/* Set when the environment or sorting changes and the lights need rebuilding */
+bool lights_dirty = true;
 
-/* One iteration of 1d haar transform for use in haar2d */
-void haar(vector<float>::iterator vec, int w, int res, bool is_col){
-	float *tmp = new float[w];
-	memset(tmp, 0, sizeof(float)*w);
-	
-	int offset = is_col ? res : 1;
-	
-	w /= 2;
-	for (int i=0; i<w; i++) {
-		tmp[i] = (vec[2*i*offset] + vec[(2*i+1)*offset]) / sqrt(2.0);
-		tmp[i+w] = (vec[2*i*offset] - vec[(2*i+1)*offset]) / sqrt(2.0);
-	}
-	for (int i=0; i<2*w; i++) {
-		vec[i*offset] = tmp[i];
-	}
-	delete [] tmp;
-}
-
-/*
-2d haar transform on each face of a cubemap
-*/
-void haar2d(vector<float>& vec){
-	
-	int resolution = sqrt(vec.size());
-	
-	int w = resolution;
-	
-	while (w>1)	{
-		vector<float>::iterator row_iter = vec.begin();
-		for (int i=0; i<resolution; i++){
-			haar(row_iter,w,resolution,false);
-			row_iter += resolution;
-		}
-		vector<float>::iterator col_iter = vec.begin();
-		for (int i=0; i<resolution; i++){
-			haar(col_iter,w,resolution,true);
-			col_iter += 1;
-		}
-		w /= 2;
-	}
-}
+LightList red_lights;
+LightList green_lights;
+LightList blue_lights;
 
-/* Creates the light transport matrix from images in 'folder' */
-void build_transport_matrix(char *folder, const int num_files) {
-	
-	red_matrix = new vector<float>[num_files];
-	green_matrix = new vector<float>[num_files];
-	blue_matrix = new vector<float>[num_files];
-	
-	vector<unsigned char> image; //the raw pixels
-	
-	/* Load files into matrix */
-	for (int i=0; i<num_files; i++) {
-		char filename[50];
-        if(num_files > 10000)
-          sprintf(filename, "%s/%05d.png", folder, i);
-        else if(num_files > 1000)
-          sprintf(filename, "%s/%04d.png", folder, i);
-        else
-          sprintf(filename, "%s/%03d.png", folder, i);
-		clog << "Loading file: " << filename << "\r";
-		
-		unsigned error = lodepng::decode(image, width, height, filename);
-		
-		if(error) {
-			cout << "decoder error " << error
-		 	<< ": " << lodepng_error_text(error) << endl;
-			exit(1);
-		}
-
-		for(unsigned int j=0; j<image.size(); j+=4) {
-			red_matrix[i].push_back(image[j]/255.0f);
-			green_matrix[i].push_back(image[j+1]/255.0f);
-			blue_matrix[i].push_back(image[j+2]/255.0f);
-		}
-		image.clear();
-	}
-	
-	clog << "\n";
-	
-	/* Haar transform rows of matrix */
-	vector<float> red_row;
-	vector<float> green_row;
-	vector<float> blue_row;
-	for (unsigned int pixel=0; pixel<width*height; pixel++) {
-		clog << "Haar transforming row " << pixel << " of " <<width*height<<"\r";
-		for (int i=0; i<num_files; i++) {
-			red_row.push_back(red_matrix[i][pixel]);
-			green_row.push_back(green_matrix[i][pixel]);
-			blue_row.push_back(blue_matrix[i][pixel]);
-		}
-		
-		#ifdef USEHAAR
-		haar2d(red_row);
-		haar2d(green_row);
-		haar2d(blue_row);
-		#endif
-		
-		for (int i=0; i<num_files; i++) {
-			red_matrix[i][pixel] = red_row[i];
-			green_matrix[i][pixel] = green_row[i];
-			blue_matrix[i][pixel] = blue_row[i];
-		}
-		red_row.clear();
-		green_row.clear();
-		blue_row.clear();
-	}
-	clog << "\nAlmost done...\n";
-	
-	/* Fine average intensities for weighting*/
-	for (unsigned int i=0; i<num_files; i++) {
-		float red_total = 0.0f;
-		float green_total = 0.0f;
-		float blue_total = 0.0f;
-		for(unsigned int pixel=0; pixel<width*height; pixel++) {
-			red_total += red_matrix[i][pixel];
-			green_total += green_matrix[i][pixel];
-			blue_total += blue_matrix[i][pixel];
-		}
-		red_total /= float(width*height);
-		green_total /= float(width*height);
-		blue_total /= float(width*height);
-		
-		red_means.push_back(red_total);
-		green_means.push_back(green_total);
-		blue_means.push_back(blue_total);
-	}
-}
 
 void build_environment_vector(char *folder) {
-	red_env.clear();
-	green_env.clear();
-	blue_env.clear();
 	max_light = 0;
-	
-	unsigned int NUM_FACES = 6;
-	unsigned int resolution = scene_resolution;
-	
-	vector<unsigned char> image; //the raw pixels
-	
-	vector<float> red_env_face;
-	vector<float> green_env_face;
-	vector<float> blue_env_face;
-	
-	for (unsigned int i=0; i<NUM_FACES; i++) {
-		char filename[50];
-		sprintf(filename, "environment_maps/%s/%s%d.png", folder, folder, i);
-		
-		lodepng::decode(image, resolution, resolution, filename);
-
-		for(unsigned int j=0; j<image.size(); j+=4) {
-			red_env_face.push_back(image[j]/255.0f);
-			green_env_face.push_back(image[j+1]/255.0f);
-			blue_env_face.push_back(image[j+2]/255.0f);
-		}
-		image.clear();
-		
-		/* Downsample to desired resolution */
-		vector<float> new_red;
-		vector<float> new_green;
-		vector<float> new_blue;
-		while (resolution > env_resolution) {
-			resolution /= 2;
-			for (unsigned int y=0; y<resolution; y++) {
-				for (unsigned int x=0; x<resolution; x++){
-					int p0 = 2*x + 4*y*resolution;
-					int p1 = p0 + 1;
-					int p2 = p0 + 2*resolution;
-					int p3 = p0 + 2*resolution + 1;
-
-					float ave;
-					ave = red_env_face[p0] + red_env_face[p1] + red_env_face[p2] + red_env_face[p3];
-					ave /= 4.0f;
-					new_red.push_back(ave);
-					ave = green_env_face[p0] + green_env_face[p1] + green_env_face[p2] + green_env_face[p3];
-					ave /= 4.0f;
-					new_green.push_back(ave);
-					ave = blue_env_face[p0] + blue_env_face[p1] + blue_env_face[p2] + blue_env_face[p3];
-					ave /= 4.0f;
-					new_blue.push_back(ave);
-				}
-			}
-			red_env_face = new_red;
-			green_env_face = new_green;
-			blue_env_face = new_blue;
-			new_red.clear();
-			new_green.clear();
-			new_blue.clear();	
-		}
-		
-		/*Insert this side of cubemap into envirornmap vector */
-		red_env.insert(red_env.end(),red_env_face.begin(),red_env_face.end());
-		green_env.insert(green_env.end(),green_env_face.begin(),green_env_face.end());
-		blue_env.insert(blue_env.end(),blue_env_face.begin(),blue_env_face.end());
-		red_env_face.clear();
-		green_env_face.clear();
-		blue_env_face.clear();
-	}
+	load_environment_map(folder, env_resolution, red_env, green_env, blue_env);
+	reset_shifted_coefficients(red_coeffs, red_env, env_resolution, scene.wavelet);
+	reset_shifted_coefficients(green_coeffs, green_env, env_resolution, scene.wavelet);
+	reset_shifted_coefficients(blue_coeffs, blue_env, env_resolution, scene.wavelet);
+	env_shift = 0;
+	lights_dirty = true;
 }
 
 bool naive_sort(pair<int,float> i, pair<int,float> j){
@@ -278,21 +134,35 @@ bool naive_sort(pair<int,float> i, pair<int,float> j){
 
 /* One sort function for each color channel */
 bool red_weighted_sort(pair<int,float> i, pair<int,float> j){
-	float comp1 = i.second * red_means[i.first];
-	float comp2 = j.second * red_means[j.first];
+	float comp1 = i.second * transport.red_stats.mean[i.first];
+	float comp2 = j.second * transport.red_stats.mean[j.first];
 	return comp1>comp2;
 }
 bool green_weighted_sort(pair<int,float> i, pair<int,float> j){
-	float comp1 = i.second * green_means[i.first];
-	float comp2 = j.second * green_means[j.first];
+	float comp1 = i.second * transport.green_stats.mean[i.first];
+	float comp2 = j.second * transport.green_stats.mean[j.first];
 	return comp1>comp2;
 }
 bool blue_weighted_sort(pair<int,float> i, pair<int,float> j){
-	float comp1 = i.second * blue_means[i.first];
-	float comp2 = j.second * blue_means[j.first];
+	float comp1 = i.second * transport.blue_stats.mean[i.first];
+	float comp2 = j.second * transport.blue_stats.mean[j.first];
 	return comp1>comp2;
 }
 
+/* Rank by the energy a light adds to the image, |coefficient| * column norm */
+bool red_energy_sort(pair<int,float> i, pair<int,float> j){
+	return fabs(i.second) * transport.red_stats.norm[i.first]
+		> fabs(j.second) * transport.red_stats.norm[j.first];
+}
+bool green_energy_sort(pair<int,float> i, pair<int,float> j){
+	return fabs(i.second) * transport.green_stats.norm[i.first]
+		> fabs(j.second) * transport.green_stats.norm[j.first];
+}
+bool blue_energy_sort(pair<int,float> i, pair<int,float> j){
+	return fabs(i.second) * transport.blue_stats.norm[i.first]
+		> fabs(j.second) * transport.blue_stats.norm[j.first];
+}
+
 
 /* Calculate values for light vector */
 void calculate_lights_used(){
@@ -301,16 +171,10 @@ void calculate_lights_used(){
 	green_lights.clear();
 	blue_lights.clear();
 	
-	/* make copy to use with haar */
-	vector<float> red_haar(red_env);
-	vector<float> green_haar(green_env);
-	vector<float> blue_haar(blue_env);
-	
-	#ifdef USEHAAR
-	haar2d(red_haar);
-	haar2d(green_haar);
-	haar2d(blue_haar);
-	#endif
+	/* Transformed environment at the current shift */
+	const vector<float> &red_haar = shifted_coefficients(red_coeffs, env_shift);
+	const vector<float> &green_haar = shifted_coefficients(green_coeffs, env_shift);
+	const vector<float> &blue_haar = shifted_coefficients(blue_coeffs, env_shift);
 	
 	/* Create new lights vectors. This just uses all of them right now */
 	for (unsigned int i=0; i<red_env.size(); i++) {
@@ -323,10 +187,16 @@ void calculate_lights_used(){
 		sort(red_lights.begin(),red_lights.end(), naive_sort);
 		sort(green_lights.begin(),green_lights.end(), naive_sort);
 		sort(blue_lights.begin(),blue_lights.end(), naive_sort);
-	} else {
+	} else if (sort_mode == WEIGHTED) {
 		sort(red_lights.begin(),red_lights.end(), red_weighted_sort);
 		sort(green_lights.begin(),green_lights.end(), green_weighted_sort);
 		sort(blue_lights.begin(),blue_lights.end(), blue_weighted_sort);
+	} else if (sort_mode == ENERGY) {
+		sort(red_lights.begin(),red_lights.end(), red_energy_sort);
+		sort(green_lights.begin(),green_lights.end(), green_energy_sort);
+		sort(blue_lights.begin(),blue_lights.end(), blue_energy_sort);
+	} else {
+		rank_shared_lights(transport, red_lights, green_lights, blue_lights);
 	}
 	
 }
@@ -344,6 +214,38 @@ void shift_env_map(int num) {
 		rotate(green_env.begin(), green_env.end() + amount, green_env.end());
 		rotate(blue_env.begin(), blue_env.end() + amount, blue_env.end());
 	}
+	env_shift = (env_shift + num) % (int)(CUBEMAP_FACES*env_resolution);
+	lights_dirty = true;
+}
+
+/* Adds the first 'lights' chosen lights into 'pre_image' from whichever storage is in use */
+float relight_frame(int lights, float *pre_image) {
+	if (storage == SPARSE_ROWS) {
+		return relight_sparse_rows(red_rows, green_rows, blue_rows, transport.num_lights,
+			red_lights, green_lights, blue_lights, lights, pre_image);
+	} else if (storage == SPARSE_COLUMNS) {
+		return relight_sparse_columns(red_cols, green_cols, blue_cols, red_lights,
+			green_lights, blue_lights, lights, width*height, pre_image);
+	} else if (storage == QUANTIZED_8 || storage == QUANTIZED_16) {
+		return relight_quantized(red_quant, green_quant, blue_quant, red_lights,
+			green_lights, blue_lights, lights, pre_image);
+	} else if (storage == HALF) {
+		return relight_half(red_half, green_half, blue_half, red_lights,
+			green_lights, blue_lights, lights, pre_image);
+	} else if (storage == CPCA) {
+		return relight_cpca(red_cpca, green_cpca, blue_cpca, red_lights,
+			green_lights, blue_lights, lights, pre_image);
+	} else if (storage == LOW_RANK) {
+		return relight_low_rank(red_svd, green_svd, blue_svd, red_lights,
+			green_lights, blue_lights, lights, pre_image);
+	} else if (storage == TILED) {
+		return relight_tiled(red_tiles, green_tiles, blue_tiles, red_lights,
+			green_lights, blue_lights, lights, pre_image);
+	} else if (storage == INTERLEAVED) {
+		return relight_interleaved(rgb_cols, red_lights, green_lights, blue_lights,
+			lights, pre_image);
+	}
+	return relight_dense(transport, red_lights, green_lights, blue_lights, lights, pre_image);
 }
 
 
@@ -376,11 +278,16 @@ void keyboard(unsigned char key, int x, int y) {
 	char *filename;
 	switch(key){
 		case 'w':
-            sort_mode = sort_mode == NAIVE ? WEIGHTED : NAIVE;
+            sort_mode = (sort_mode + 1) % 4;
+			lights_dirty = true;
 			if (sort_mode==NAIVE){
 				cout << "Now using Naive sort (Sorted by wavelet coefficients)" << endl;
-			} else {
+			} else if (sort_mode==WEIGHTED) {
 				cout << "Now using transport-weighted sorting" << endl;
+			} else if (sort_mode==ENERGY) {
+				cout << "Now using energy sorting (coefficient times transport norm)" << endl;
+			} else {
+				cout << "Now using shared sorting (luminance of the energy, one order for all channels)" << endl;
 			}
 			break;
 		case 'a':
@@ -410,16 +317,18 @@ void keyboard(unsigned char key, int x, int y) {
 			break;
 		case 'p':
 			num_wavelets += 10;
-			num_wavelets = min(num_wavelets, (int)red_means.size());
+			num_wavelets = min(num_wavelets, (int)transport.num_lights);
 			cout << "Now using " << num_wavelets << " wavelets per frame" << endl;
 			break;
 		case 'h':
 			print_help();
 			break;
 		case 27:  // Escape to quit
-			delete [] red_matrix;
-			delete [] green_matrix;
-			delete [] blue_matrix;
+			free_transport(transport);
+			free_tiled_channel(red_tiles);
+			free_tiled_channel(green_tiles);
+			free_tiled_channel(blue_tiles);
+			free_interleaved_columns(rgb_cols);
 			exit(0);
 			break;
 	}
@@ -452,19 +361,127 @@ void init() {
 	max_light = 0;
 	env_move_rate = 1;
 
-    /** calculate env_resolution based on number of files in scenefolder */
-    string pngs = string(scenefolder) + "/*.png";
-    if(glob(pngs.c_str(), GLOB_NOSORT, NULL, &gl) == 0)
-        numSceneFiles = gl.gl_pathc;
-    globfree(&gl);
+	/* The manifest (or the folder's images) fixes the light resolution */
+	load_scene(scene, scenefolder);
+	size_t numSceneFiles = scene.files.size();
+	env_resolution = scene.env_resolution;
+	if (basis_option >= 0)
+		scene.wavelet.basis = basis_option;
+	if (decomposition_option >= 0)
+		scene.wavelet.decomposition = decomposition_option;
+	clog << rendered_lights(scene) << " of " << numSceneFiles << " lights rendered at "
+		<< env_resolution << "x" << env_resolution << " per cube face, "
+		<< wavelet_name(scene.wavelet.basis) << " wavelets, "
+		<< decomposition_name(scene.wavelet.decomposition) << " decomposition\n";
 
     num_wavelets = min(num_wavelets, (int)numSceneFiles);
 	
-    env_resolution = sqrt(numSceneFiles / 6.0);
+	/* Reuse the finished matrix from an earlier run when nothing changed */
+	if (cachefile.empty())
+		cachefile = string(scenefolder) + "/transport.cache";
+	CacheKey key = transport_cache_key(scene, width, height);
+	if (memory_budget == 0)
+		memory_budget = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+	size_t transport_bytes = 3 * sizeof(float) * width * height * numSceneFiles;
+	
+	if (use_cache && refresh_transport_cache(cachefile.c_str(), key, scene, num_threads)
+		&& load_transport_cache(transport, cachefile.c_str(), key)) {
+		clog << "Loaded transport cache " << cachefile << "\n";
+	} else if (transport_bytes > memory_budget && (use_cache || storage == SPARSE_ROWS)) {
+		/*
+		Too big to build in memory, so build it in the cache file instead. Sparse
+		rows are thresholded from the mapped file, so without a cache they get a
+		scratch file that is removed as soon as it is mapped
+		*/
+		string streamfile = use_cache ? cachefile : cachefile + ".scratch";
+		clog << "Transport needs " << (transport_bytes >> 20) << " MB, streaming it to "
+			<< streamfile << "\n";
+		vector<FileStamp> stamps = stamp_light_files(scene);
+		bool streamed = stream_transport_cache(streamfile.c_str(), key, scene, stamps,
+			num_threads, memory_budget) && load_transport_cache(transport, streamfile.c_str(), key);
+		if (!use_cache)
+			remove(streamfile.c_str());
+		if (!streamed) {
+			cout << "Could not stream the transport matrix to " << streamfile << endl;
+			exit(1);
+		}
+	} else {
+		/* Stamp the files first so edits made while loading are caught next time */
+		vector<FileStamp> stamps;
+		if (use_cache)
+			stamps = stamp_light_files(scene);
+		build_transport_matrix(transport, scene, width, height, num_threads);
+		if (use_cache)
+			save_transport_cache(transport, cachefile.c_str(), key, stamps);
+	}
 	
-	build_transport_matrix(scenefolder, numSceneFiles);
 	char* temp = "Grace";
 	build_environment_vector(temp);
+	
+	/* Keep only the largest coefficients of every pixel row */
+	if (storage == SPARSE_ROWS) {
+		build_sparse_rows(transport, top_k, epsilon, red_rows, green_rows, blue_rows);
+		release_columns(transport);
+	}
+	
+	/* Keep the coefficients of every light column above epsilon */
+	if (storage == SPARSE_COLUMNS) {
+		build_sparse_columns(transport, epsilon, red_cols, green_cols, blue_cols);
+		release_columns(transport);
+	}
+	
+	/* Regroup the columns so each block of pixels holds all of its lights */
+	if (storage == TILED) {
+		build_tiled_channels(transport, true, red_tiles, green_tiles, blue_tiles);
+		release_columns(transport);
+	}
+	
+	/* One RGB column per light, read as one stream once the lights share an order */
+	if (storage == INTERLEAVED) {
+		build_interleaved_columns(transport, true, rgb_cols);
+		release_columns(transport);
+		sort_mode = SHARED;
+	}
+	
+	/* Compress the columns, measuring the first frame against the dense one */
+	if (storage == QUANTIZED_8 || storage == QUANTIZED_16 || storage == HALF || storage == CPCA
+		|| storage == LOW_RANK) {
+		if (storage == HALF) {
+			build_half_columns(transport, red_half, green_half, blue_half);
+		} else if (storage == CPCA) {
+			/* Clustering is slow, so it is kept next to the transport cache */
+			string cpca_file = cachefile + ".cpca";
+			if (use_cache && load_cpca(cpca_file.c_str(), transport, key, cpca_clusters,
+				cpca_basis, red_cpca, green_cpca, blue_cpca)) {
+				clog << "Loaded clustered PCA " << cpca_file << "\n";
+			} else {
+				build_cpca(transport, cpca_clusters, cpca_basis, red_cpca, green_cpca, blue_cpca);
+				if (use_cache)
+					save_cpca(cpca_file.c_str(), transport, key, red_cpca, green_cpca, blue_cpca);
+			}
+		} else if (storage == LOW_RANK) {
+			string svd_file = cachefile + ".svd";
+			if (use_cache && load_low_rank(svd_file.c_str(), transport, key, svd_rank,
+				red_svd, green_svd, blue_svd)) {
+				clog << "Loaded low rank factors " << svd_file << "\n";
+			} else {
+				build_low_rank(transport, svd_rank, red_svd, green_svd, blue_svd);
+				if (use_cache)
+					save_low_rank(svd_file.c_str(), transport, key, red_svd, green_svd, blue_svd);
+			}
+		} else {
+			build_quantized_columns(transport, storage == QUANTIZED_8 ? 8 : 16,
+				red_quant, green_quant, blue_quant);
+		}
+		
+		calculate_lights_used();
+		int lights = min(num_wavelets, (int)red_lights.size());
+		vector<float> dense(3*width*height, 0.0f), narrow(3*width*height, 0.0f);
+		relight_dense(transport, red_lights, green_lights, blue_lights, lights, &dense[0]);
+		relight_frame(lights, &narrow[0]);
+		clog << "First frame PSNR: " << image_psnr(&dense[0], &narrow[0], dense.size()) << " dB\n";
+		release_columns(transport);
+	}
 
 	vertexshader = initshaders(GL_VERTEX_SHADER, "shaders/vert.glsl");
 	fragmentshader = initshaders(GL_FRAGMENT_SHADER, "shaders/frag.glsl");
@@ -561,33 +578,19 @@ void draw_env_map() {
 void display(){
 	glClear(GL_COLOR_BUFFER_BIT);
 	
-	/* Calculate weights for 'lights' vector */
-	calculate_lights_used();
+	/* Calculate weights for 'lights' vector, only when the lighting changed */
+	if (lights_dirty) {
+		calculate_lights_used();
+		lights_dirty = false;
+	}
 	
 	/* initialize pixel vector to set as texture */
 	vector<float> pre_image;
 	pre_image.resize(3*width*height, 0);
 	
-	/* Loop through the chosen lights and combine them with their weight */
-	
-	for (unsigned int j=0; j<num_wavelets; j++) {
-		int r_ind = red_lights[j].first;
-		int g_ind = green_lights[j].first;
-		int b_ind = blue_lights[j].first;
-		
-		float r_weight = red_lights[j].second;
-		float g_weight = green_lights[j].second;
-		float b_weight = blue_lights[j].second;
-		
-		for (unsigned int i=0; i<width*height; i++) {
-			pre_image[3*i] += red_matrix[r_ind][i]*r_weight;
-			pre_image[3*i+1] += green_matrix[g_ind][i]*g_weight;
-			pre_image[3*i+2] += blue_matrix[b_ind][i]*b_weight;
-			max_light = max(pre_image[3*i],max_light);
-			max_light = max(pre_image[3*i+1],max_light);
-			max_light = max(pre_image[3*i+2],max_light);
-		}
-	}
+	/* Combine the chosen lights with their weight */
+	float frame_max = relight_frame(num_wavelets, &pre_image[0]);
+	max_light = max(max_light, frame_max);
 	
 	vector<unsigned char> image;
 	
@@ -628,12 +631,108 @@ parse_command_line(int argc, char* argv[]) {
         } else if (strcmp(argv[i],"-f") == 0) {
             scenefolder = argv[i+1];
             i++;
+        } else if (strcmp(argv[i],"-j") == 0) {
+            num_threads = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i],"-c") == 0) {
+            if (strcmp(argv[i+1],"none") == 0)
+                use_cache = false;
+            else
+                cachefile = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i],"-m") == 0) {
+            memory_budget = (size_t)atoi(argv[i+1]) << 20;
+            i++;
+        } else if (strcmp(argv[i],"-s") == 0) {
+            if (strcmp(argv[i+1],"rows") == 0)
+                storage = SPARSE_ROWS;
+            else if (strcmp(argv[i+1],"cols") == 0)
+                storage = SPARSE_COLUMNS;
+            else if (strcmp(argv[i+1],"q8") == 0)
+                storage = QUANTIZED_8;
+            else if (strcmp(argv[i+1],"q16") == 0)
+                storage = QUANTIZED_16;
+            else if (strcmp(argv[i+1],"half") == 0)
+                storage = HALF;
+            else if (strcmp(argv[i+1],"cpca") == 0)
+                storage = CPCA;
+            else if (strcmp(argv[i+1],"svd") == 0)
+                storage = LOW_RANK;
+            else if (strcmp(argv[i+1],"tiles") == 0)
+                storage = TILED;
+            else if (strcmp(argv[i+1],"rgb") == 0)
+                storage = INTERLEAVED;
+            else
+                storage = DENSE;
+            i++;
+        } else if (strcmp(argv[i],"-k") == 0) {
+            top_k = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i],"-e") == 0) {
+            epsilon = atof(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i],"-n") == 0) {
+            cpca_clusters = max(1, atoi(argv[i+1]));
+            i++;
+        } else if (strcmp(argv[i],"-b") == 0) {
+            cpca_basis = max(0, atoi(argv[i+1]));
+            i++;
+        } else if (strcmp(argv[i],"-v") == 0) {
+            svd_rank = max(1, atoi(argv[i+1]));
+            i++;
+        } else if (strcmp(argv[i],"-w") == 0) {
+            basis_option = wavelet_basis(argv[i+1]);
+            if (basis_option < 0) {
+                cout << "Unknown wavelet basis " << argv[i+1] << endl;
+                exit(1);
+            }
+            i++;
+        } else if (strcmp(argv[i],"-d") == 0) {
+            decomposition_option = decomposition_type(argv[i+1]);
+            if (decomposition_option < 0) {
+                cout << "Unknown decomposition " << argv[i+1] << endl;
+                exit(1);
+            }
+            i++;
         } else if (strcmp(argv[i],"-h") == 0) {
             cout << "Command Line Options:" << endl;
             cout << "-f [path/to/scene/folder]" << endl;
+            cout << "   A lights.txt in the folder maps images to cubemap lights" << endl;
             cout << "   Defaults to povray/tree_16x16/sharp_tree_images" << endl;
             cout << "-r [resolution]" << endl;
             cout << "   Resolution for the scene images. Defaults to 256" << endl;
+            cout << "-j [threads]" << endl;
+            cout << "   Threads used to load the scene. Defaults to one per core" << endl;
+            cout << "-c [path/to/cache | none]" << endl;
+            cout << "   Transport cache file. Defaults to transport.cache in the scene folder" << endl;
+            cout << "-m [megabytes]" << endl;
+            cout << "   Memory budget for loading the scene. Larger scenes are streamed" << endl;
+            cout << "   through the cache file, or with -s rows and -c none through a" << endl;
+            cout << "   scratch file. Defaults to half of physical memory" << endl;
+            cout << "-s [dense | rows | cols | q8 | q16 | half | cpca | svd | tiles | rgb]" << endl;
+            cout << "   Transport storage. 'rows' keeps only the largest coefficients" << endl;
+            cout << "   of every pixel, 'cols' the nonzero ones of every light (see -e)," << endl;
+            cout << "   'q8' and 'q16' store 8 or 16 bit coefficients with a scale per" << endl;
+            cout << "   block of pixels, 'half' 16 bit floats and 'cpca' clusters the" << endl;
+            cout << "   pixels and keeps a few principal components of each cluster" << endl;
+            cout << "   (see -n and -b), 'svd' a truncated SVD (see -v) and 'tiles'" << endl;
+            cout << "   regroups the dense columns into 64x64 pixel tiles that stay in" << endl;
+            cout << "   cache while every light is added. 'rgb' interleaves the channels" << endl;
+            cout << "   of every light and starts with the shared sort. Defaults to dense" << endl;
+            cout << "-k [coefficients]" << endl;
+            cout << "   Coefficients kept per pixel with -s rows, 0 for all. Defaults to 64" << endl;
+            cout << "-e [epsilon]" << endl;
+            cout << "   Smallest coefficient kept with -s rows or cols. Defaults to 0" << endl;
+            cout << "-n [clusters]" << endl;
+            cout << "   Pixel clusters with -s cpca. Defaults to 64" << endl;
+            cout << "-b [basis vectors]" << endl;
+            cout << "   Principal components per cluster with -s cpca. Defaults to 8" << endl;
+            cout << "-v [rank]" << endl;
+            cout << "   Singular vectors kept with -s svd. Defaults to 32" << endl;
+            cout << "-w [haar | d4 | cdf97]" << endl;
+            cout << "   Wavelet basis. Defaults to the scene's (see lights.txt), else haar" << endl;
+            cout << "-d [nonstandard | standard]" << endl;
+            cout << "   2D wavelet decomposition. Defaults to the scene's, else nonstandard" << endl;
             exit(0);
         }
     }
@@ -0,0 +1,293 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include "omp.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HALF_SIMD
+#endif
+
+#include "quantize.h"
+
+using namespace std;
+
+/*
+Maps each QUANT_BLOCK pixels of every column onto [-levels, levels] around
+the middle of their range, so the error is at most half a step of that block.
+Returns the squared error summed over the channel
+*/
+template <typename T>
+static double quantize_channel(float **cols, unsigned int num_lights, size_t pixels,
+	int levels, vector<T> &q, QuantizedColumns &out) {
+	out.pixels = pixels;
+	out.blocks = (pixels + QUANT_BLOCK - 1) / QUANT_BLOCK;
+	q.resize(num_lights * pixels);
+	out.scale.resize(num_lights * out.blocks);
+	out.offset.resize(num_lights * out.blocks);
+	
+	double error = 0.0;
+	#pragma omp parallel for schedule(static) reduction(+:error)
+	for (int i=0; i<(int)num_lights; i++) {
+		const float *col = cols[i];
+		T *qcol = &q[(size_t)i * pixels];
+		for (size_t b=0; b<out.blocks; b++) {
+			size_t p0 = b * QUANT_BLOCK;
+			size_t p1 = min(p0 + QUANT_BLOCK, pixels);
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (size_t p=p0; p<p1; p++) {
+				lo = min(lo, col[p]);
+				hi = max(hi, col[p]);
+			}
+			
+			float offset = 0.5f * (lo + hi);
+			float scale = 0.5f * (hi - lo) / levels;
+			float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+			out.offset[(size_t)i * out.blocks + b] = offset;
+			out.scale[(size_t)i * out.blocks + b] = scale;
+			for (size_t p=p0; p<p1; p++) {
+				long v = lrintf((col[p] - offset) * inv);
+				v = max(-(long)levels, min((long)levels, v));
+				qcol[p] = (T)v;
+				double d = (double)offset + (double)scale * v - col[p];
+				error += d * d;
+			}
+		}
+	}
+	return error;
+}
+
+/* Peak signal to noise ratio in dB, against the largest reference magnitude */
+static double psnr(double squared_error, size_t count, double peak) {
+	if (squared_error <= 0.0) return INFINITY;
+	return 10.0 * log10(peak * peak * count / squared_error);
+}
+
+static float largest_magnitude(float **cols, unsigned int num_lights, size_t pixels) {
+	float peak = 0.0f;
+	#pragma omp parallel for schedule(static) reduction(max:peak)
+	for (int i=0; i<(int)num_lights; i++)
+		for (size_t p=0; p<pixels; p++)
+			peak = max(peak, fabsf(cols[i][p]));
+	return peak;
+}
+
+/*
+Quantizes every channel of the dense (wavelet domain) columns of 't' to 'bits'
+(8 or 16) bit integers, and reports the memory saved and the coefficient PSNR
+*/
+void build_quantized_columns(const Transport &t, int bits,
+	QuantizedColumns &red, QuantizedColumns &green, QuantizedColumns &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	float **cols[3] = {t.red, t.green, t.blue};
+	QuantizedColumns *out[3] = {&red, &green, &blue};
+	
+	clog << "Quantizing transport to " << bits << " bits per coefficient\n";
+	double error = 0.0;
+	float peak = 0.0f;
+	for (int c=0; c<3; c++) {
+		out[c]->bits = bits;
+		out[c]->q8.clear();
+		out[c]->q16.clear();
+		if (bits == 8)
+			error += quantize_channel(cols[c], t.num_lights, pixels, 127, out[c]->q8, *out[c]);
+		else
+			error += quantize_channel(cols[c], t.num_lights, pixels, 32767, out[c]->q16, *out[c]);
+		peak = max(peak, largest_magnitude(cols[c], t.num_lights, pixels));
+	}
+	
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double quantized_bytes = 3.0 * t.num_lights * (pixels * bits / 8
+		+ red.blocks * 2 * sizeof(float));
+	clog << "Quantized transport is " << quantized_bytes / (1 << 20) << " MB instead of "
+		<< dense_bytes / (1 << 20) << " MB (" << (dense_bytes - quantized_bytes) / (1 << 20)
+		<< " MB saved), coefficient PSNR "
+		<< psnr(error, 3 * pixels * t.num_lights, peak) << " dB\n";
+}
+
+/*
+Half float conversions. The scalar versions round to nearest even like the
+F16C instructions, so both paths give the same bits
+*/
+static uint16_t half_from_float(float value) {
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = (f >> 16) & 0x8000;
+	uint32_t abs = f & 0x7fffffff;
+	
+	if (abs >= 0x7f800000) /* inf stays inf, nan stays a quiet nan */
+		return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 | ((abs >> 13) & 0x3ff) : 0);
+	if (abs >= 0x477ff000) /* rounds past the largest half */
+		return sign | 0x7c00;
+	if (abs < 0x38800000) { /* half denormal, or zero */
+		if (abs < 0x33000000) return sign;
+		uint32_t shift = 126 - (abs >> 23);
+		uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t middle = 1u << (shift - 1);
+		if (rest > middle || (rest == middle && (half & 1))) half++;
+		return sign | half;
+	}
+	uint32_t half = (abs - 0x38000000) >> 13;
+	uint32_t rest = abs & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+	return sign | half;
+}
+
+static float float_from_half(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t f;
+	if (exponent == 0x1f) {
+		f = sign | 0x7f800000 | (mantissa ? 0x400000 | (mantissa << 13) : 0);
+	} else if (exponent != 0) {
+		f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	} else if (mantissa == 0) {
+		f = sign;
+	} else {
+		/* Denormal half, normalize it for the float */
+		exponent = 113;
+		while (!(mantissa & 0x400)) {
+			mantissa <<= 1;
+			exponent--;
+		}
+		f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	float value;
+	memcpy(&value, &f, sizeof(value));
+	return value;
+}
+
+static void float_to_half_scalar(const float *in, uint16_t *out, size_t count) {
+	for (size_t i=0; i<count; i++) out[i] = half_from_float(in[i]);
+}
+
+static void half_to_float_scalar(const uint16_t *in, float *out, size_t count) {
+	for (size_t i=0; i<count; i++) out[i] = float_from_half(in[i]);
+}
+
+static void add_half_scalar(const uint16_t *col, float weight, float *acc, size_t count) {
+	for (size_t i=0; i<count; i++) acc[i] += weight * float_from_half(col[i]);
+}
+
+#ifdef HALF_SIMD
+__attribute__((target("avx,f16c")))
+static void float_to_half_f16c(const float *in, uint16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i+8<=count; i+=8) {
+		__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128((__m128i*)(out + i), h);
+	}
+	float_to_half_scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx,f16c")))
+static void half_to_float_f16c(const uint16_t *in, float *out, size_t count) {
+	size_t i = 0;
+	for (; i+8<=count; i+=8)
+		_mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+	half_to_float_scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx,f16c")))
+static void add_half_f16c(const uint16_t *col, float weight, float *acc, size_t count) {
+	const __m256 w = _mm256_set1_ps(weight);
+	size_t i = 0;
+	for (; i+8<=count; i+=8) {
+		__m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(col + i)));
+		_mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(w, v)));
+	}
+	add_half_scalar(col + i, weight, acc + i, count - i);
+}
+#endif
+
+/* F16C when this cpu has it, picked once at startup */
+static bool select_f16c() {
+	#ifdef HALF_SIMD
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+	#else
+	return false;
+	#endif
+}
+
+static const bool use_f16c = select_f16c();
+
+void float_to_half(const float *in, uint16_t *out, size_t count) {
+	#ifdef HALF_SIMD
+	if (use_f16c) return float_to_half_f16c(in, out, count);
+	#endif
+	float_to_half_scalar(in, out, count);
+}
+
+void half_to_float(const uint16_t *in, float *out, size_t count) {
+	#ifdef HALF_SIMD
+	if (use_f16c) return half_to_float_f16c(in, out, count);
+	#endif
+	half_to_float_scalar(in, out, count);
+}
+
+/* acc[i] += weight * col[i] for 'count' half floats */
+void add_half_column(const uint16_t *col, float weight, float *acc, size_t count) {
+	#ifdef HALF_SIMD
+	if (use_f16c) return add_half_f16c(col, weight, acc, count);
+	#endif
+	add_half_scalar(col, weight, acc, count);
+}
+
+/*
+Converts every channel of the dense (wavelet domain) columns of 't' to half
+floats, and reports the memory saved and the coefficient PSNR
+*/
+void build_half_columns(const Transport &t, HalfColumns &red, HalfColumns &green,
+	HalfColumns &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	float **cols[3] = {t.red, t.green, t.blue};
+	HalfColumns *out[3] = {&red, &green, &blue};
+	
+	clog << "Converting transport to half floats" << (use_f16c ? " (f16c)" : "") << "\n";
+	double error = 0.0;
+	float peak = 0.0f;
+	for (int c=0; c<3; c++) {
+		out[c]->pixels = pixels;
+		out[c]->data.resize(t.num_lights * pixels);
+		#pragma omp parallel reduction(+:error)
+		{
+			vector<float> back(pixels);
+			#pragma omp for schedule(static)
+			for (int i=0; i<(int)t.num_lights; i++) {
+				uint16_t *half = &out[c]->data[(size_t)i * pixels];
+				float_to_half(cols[c][i], half, pixels);
+				half_to_float(half, &back[0], pixels);
+				for (size_t p=0; p<pixels; p++) {
+					double d = (double)back[p] - cols[c][i][p];
+					error += d * d;
+				}
+			}
+		}
+		peak = max(peak, largest_magnitude(cols[c], t.num_lights, pixels));
+	}
+	
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double half_bytes = 3.0 * pixels * t.num_lights * sizeof(uint16_t);
+	clog << "Half float transport is " << half_bytes / (1 << 20) << " MB instead of "
+		<< dense_bytes / (1 << 20) << " MB, coefficient PSNR "
+		<< psnr(error, 3 * pixels * t.num_lights, peak) << " dB\n";
+}
+
+/* PSNR of 'test' against 'reference', peaking at the brightest reference value */
+double image_psnr(const float *reference, const float *test, size_t count) {
+	double error = 0.0;
+	float peak = 0.0f;
+	for (size_t i=0; i<count; i++) {
+		double d = (double)test[i] - reference[i];
+		error += d * d;
+		peak = max(peak, fabsf(reference[i]));
+	}
+	return psnr(error, count, peak);
+}
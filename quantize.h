@@ -0,0 +1,46 @@
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "transport.h"
+
+#ifndef __INCLUDEQUANTIZE
+#define __INCLUDEQUANTIZE
+
+/* Pixels of a column sharing one scale and offset */
+const int QUANT_BLOCK = 256;
+
+/*
+One channel of the transport with every column stored as 8 or 16 bit integers.
+Pixel p of light i is offset[k] + scale[k]*q[i*pixels + p] where
+k = i*blocks + p/QUANT_BLOCK. Only the vector matching 'bits' is filled
+*/
+struct QuantizedColumns {
+	int bits;
+	size_t pixels;
+	size_t blocks; /* per column */
+	std::vector<int8_t> q8;
+	std::vector<int16_t> q16;
+	std::vector<float> scale;
+	std::vector<float> offset;
+};
+
+/*
+One channel of the transport stored as IEEE half floats, pixel p of light i
+at data[i*pixels + p]. Keeps 11 significant bits at half the dense memory
+*/
+struct HalfColumns {
+	size_t pixels;
+	std::vector<uint16_t> data;
+};
+
+void build_quantized_columns(const Transport &t, int bits,
+	QuantizedColumns &red, QuantizedColumns &green, QuantizedColumns &blue);
+void build_half_columns(const Transport &t, HalfColumns &red, HalfColumns &green,
+	HalfColumns &blue);
+void float_to_half(const float *in, uint16_t *out, size_t count);
+void half_to_float(const uint16_t *in, float *out, size_t count);
+void add_half_column(const uint16_t *col, float weight, float *acc, size_t count);
+double image_psnr(const float *reference, const float *test, size_t count);
+
+#endif
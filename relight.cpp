@@ -0,0 +1,427 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "omp.h"
+
+#include "relight.h"
+
+using namespace std;
+
+static bool larger_energy(const pair<int,float> &a, const pair<int,float> &b) {
+	return a.second > b.second;
+}
+
+/*
+Relighting kernels. Each adds the first 'num_wavelets' lights of every channel
+into 'pre_image', an RGB interleaved width*height float image, and returns the
+largest value it saw for normalizing the result
+*/
+
+/*
+Reorders the three lists, given in light order, by one shared ranking: the
+luminance of the energy each light adds, |coefficient| * column norm in every
+channel. Entry j of each list then names the same light, so storages that keep
+a light's channels together read one column per light instead of three
+*/
+void rank_shared_lights(const Transport &t, LightList &red, LightList &green, LightList &blue) {
+	LightList ranked;
+	for (unsigned int i=0; i<red.size(); i++) {
+		float energy = LUMINANCE_RED * fabsf(red[i].second) * t.red_stats.norm[i]
+			+ LUMINANCE_GREEN * fabsf(green[i].second) * t.green_stats.norm[i]
+			+ LUMINANCE_BLUE * fabsf(blue[i].second) * t.blue_stats.norm[i];
+		ranked.push_back(make_pair(red[i].first, energy));
+	}
+	sort(ranked.begin(), ranked.end(), larger_energy);
+	
+	LightList r, g, b;
+	for (unsigned int j=0; j<ranked.size(); j++) {
+		int i = ranked[j].first;
+		r.push_back(red[i]);
+		g.push_back(green[i]);
+		b.push_back(blue[i]);
+	}
+	red.swap(r);
+	green.swap(g);
+	blue.swap(b);
+}
+
+/* Loop through the chosen lights and combine them with their weight */
+float relight_dense(const Transport &t, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	float max_light = 0.0f;
+	const unsigned int pixels = t.width*t.height;
+	const ChannelView r_view = channel_view(t, 0);
+	const ChannelView g_view = channel_view(t, 1);
+	const ChannelView b_view = channel_view(t, 2);
+	
+	for (int j=0; j<num_wavelets; j++) {
+		const float *r_col = r_view.data + red[j].first*r_view.stride;
+		const float *g_col = g_view.data + green[j].first*g_view.stride;
+		const float *b_col = b_view.data + blue[j].first*b_view.stride;
+		
+		float r_weight = red[j].second;
+		float g_weight = green[j].second;
+		float b_weight = blue[j].second;
+		
+		for (unsigned int i=0; i<pixels; i++) {
+			pre_image[3*i] += r_col[i]*r_weight;
+			pre_image[3*i+1] += g_col[i]*g_weight;
+			pre_image[3*i+2] += b_col[i]*b_weight;
+		}
+	}
+	
+	/* Largest value of the finished image, as the other kernels return */
+	for (unsigned int i=0; i<3*pixels; i++)
+		max_light = max(pre_image[i],max_light);
+	return max_light;
+}
+
+/* Coefficients of the chosen lights by light index, zero for the rest */
+static void light_weights(const LightList &lights, int num_wavelets, vector<float> &weights) {
+	fill(weights.begin(), weights.end(), 0.0f);
+	for (int j=0; j<num_wavelets; j++)
+		weights[lights[j].first] = lights[j].second;
+}
+
+/*
+Each pixel is the sparse dot product of its thresholded row with the chosen
+lights, so the cost follows the number of kept coefficients
+*/
+float relight_sparse_rows(const SparseRows &red_rows, const SparseRows &green_rows,
+	const SparseRows &blue_rows, unsigned int num_lights, const LightList &red,
+	const LightList &green, const LightList &blue, int num_wavelets, float *pre_image) {
+	vector<float> weights[3];
+	const SparseRows *rows[3] = {&red_rows, &green_rows, &blue_rows};
+	const LightList *lights[3] = {&red, &green, &blue};
+	for (int c=0; c<3; c++) {
+		weights[c].resize(num_lights);
+		light_weights(*lights[c], num_wavelets, weights[c]);
+	}
+	
+	const int pixels = red_rows.row_start.size() - 1;
+	float max_light = 0.0f;
+	for (int c=0; c<3; c++) {
+		const uint32_t *row_start = &rows[c]->row_start[0];
+		const uint32_t *light = rows[c]->light.empty() ? NULL : &rows[c]->light[0];
+		const float *value = rows[c]->value.empty() ? NULL : &rows[c]->value[0];
+		const float *w = &weights[c][0];
+		
+		#pragma omp parallel for schedule(static) reduction(max:max_light)
+		for (int p=0; p<pixels; p++) {
+			float sum = 0.0f;
+			for (uint32_t k=row_start[p]; k<row_start[p+1]; k++)
+				sum += w[light[k]] * value[k];
+			pre_image[3*p+c] += sum;
+			max_light = max(max_light, pre_image[3*p+c]);
+		}
+	}
+	return max_light;
+}
+
+/*
+Scatters the kept entries of each chosen column, so the cost follows the
+number of nonzeros rather than pixels times lights. Every thread owns a
+stripe of the image and finds its part of a column by binary search, which
+keeps the writes private without any atomics
+*/
+float relight_sparse_columns(const SparseColumns &red_cols, const SparseColumns &green_cols,
+	const SparseColumns &blue_cols, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, size_t pixels, float *pre_image) {
+	const SparseColumns *cols[3] = {&red_cols, &green_cols, &blue_cols};
+	const LightList *lights[3] = {&red, &green, &blue};
+	float max_light = 0.0f;
+	
+	#pragma omp parallel reduction(max:max_light)
+	{
+		int threads = omp_get_num_threads();
+		int id = omp_get_thread_num();
+		uint32_t lo = pixels * id / threads;
+		uint32_t hi = pixels * (id+1) / threads;
+		
+		for (int c=0; c<3; c++) {
+			const SparseColumns &sc = *cols[c];
+			for (int j=0; j<num_wavelets; j++) {
+				int light = (*lights[c])[j].first;
+				float weight = (*lights[c])[j].second;
+				const uint32_t *first = sc.pixel.empty() ? NULL : &sc.pixel[0];
+				const uint32_t *begin = lower_bound(first + sc.col_start[light],
+					first + sc.col_start[light+1], lo);
+				const uint32_t *end = lower_bound(begin, first + sc.col_start[light+1], hi);
+				const float *value = sc.value.empty() ? NULL : &sc.value[0];
+				for (const uint32_t *k=begin; k<end; k++)
+					pre_image[3*(*k)+c] += weight * value[k - first];
+			}
+		}
+		for (size_t i=3*(size_t)lo; i<3*(size_t)hi; i++)
+			max_light = max(max_light, pre_image[i]);
+	}
+	return max_light;
+}
+
+/* Pixels relit together by relight_quantized, whole QUANT_BLOCKs */
+const int QUANT_SPAN = 16*QUANT_BLOCK;
+
+/*
+Sums the chosen lights of one channel over the 'width' pixels from 'p0' into
+'acc'. A light's run of the span is contiguous so it streams from memory
+*/
+template <typename T>
+static void add_quantized_span(const QuantizedColumns &q, const T *data, const LightList &lights,
+	int num_wavelets, size_t p0, int width, float *acc) {
+	for (int j=0; j<num_wavelets; j++) {
+		const float *scale = &q.scale[(size_t)lights[j].first * q.blocks + p0 / QUANT_BLOCK];
+		const float *offset = &q.offset[(size_t)lights[j].first * q.blocks + p0 / QUANT_BLOCK];
+		const T *col = data + (size_t)lights[j].first * q.pixels + p0;
+		float weight = lights[j].second;
+		for (int b=0; b*QUANT_BLOCK < width; b++) {
+			float s = scale[b] * weight;
+			float o = offset[b] * weight;
+			int end = min(width, (b+1)*QUANT_BLOCK);
+			for (int p=b*QUANT_BLOCK; p<end; p++)
+				acc[p] += o + s * col[p];
+		}
+	}
+}
+
+/*
+Dequantizes on the fly, a span of pixels at a time. Each channel of the span
+is summed contiguously and then interleaved into 'pre_image'
+*/
+float relight_quantized(const QuantizedColumns &red_q, const QuantizedColumns &green_q,
+	const QuantizedColumns &blue_q, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	const QuantizedColumns *q[3] = {&red_q, &green_q, &blue_q};
+	const LightList *lights[3] = {&red, &green, &blue};
+	const int spans = (red_q.pixels + QUANT_SPAN - 1) / QUANT_SPAN;
+	float max_light = 0.0f;
+	
+	#pragma omp parallel reduction(max:max_light)
+	{
+		vector<float> acc(QUANT_SPAN);
+		#pragma omp for schedule(static)
+		for (int n=0; n<spans; n++) {
+			size_t p0 = (size_t)n * QUANT_SPAN;
+			int width = min((size_t)QUANT_SPAN, red_q.pixels - p0);
+			for (int c=0; c<3; c++) {
+				fill(acc.begin(), acc.begin() + width, 0.0f);
+				if (q[c]->bits == 8)
+					add_quantized_span(*q[c], &q[c]->q8[0], *lights[c], num_wavelets, p0, width, &acc[0]);
+				else
+					add_quantized_span(*q[c], &q[c]->q16[0], *lights[c], num_wavelets, p0, width, &acc[0]);
+				for (int p=0; p<width; p++) {
+					pre_image[3*(p0+p)+c] += acc[p];
+					max_light = max(max_light, pre_image[3*(p0+p)+c]);
+				}
+			}
+		}
+	}
+	return max_light;
+}
+
+/*
+Half float columns, widened with F16C where the cpu has it. Works through the
+same spans as relight_quantized
+*/
+float relight_half(const HalfColumns &red_h, const HalfColumns &green_h,
+	const HalfColumns &blue_h, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	const HalfColumns *h[3] = {&red_h, &green_h, &blue_h};
+	const LightList *lights[3] = {&red, &green, &blue};
+	const int spans = (red_h.pixels + QUANT_SPAN - 1) / QUANT_SPAN;
+	float max_light = 0.0f;
+	
+	#pragma omp parallel reduction(max:max_light)
+	{
+		vector<float> acc(QUANT_SPAN);
+		#pragma omp for schedule(static)
+		for (int n=0; n<spans; n++) {
+			size_t p0 = (size_t)n * QUANT_SPAN;
+			int width = min((size_t)QUANT_SPAN, red_h.pixels - p0);
+			for (int c=0; c<3; c++) {
+				fill(acc.begin(), acc.begin() + width, 0.0f);
+				const uint16_t *data = &h[c]->data[0];
+				for (int j=0; j<num_wavelets; j++) {
+					const uint16_t *col = data + (size_t)(*lights[c])[j].first * h[c]->pixels + p0;
+					add_half_column(col, (*lights[c])[j].second, &acc[0], width);
+				}
+				for (int p=0; p<width; p++) {
+					pre_image[3*(p0+p)+c] += acc[p];
+					max_light = max(max_light, pre_image[3*(p0+p)+c]);
+				}
+			}
+		}
+	}
+	return max_light;
+}
+
+/*
+Projects the chosen lights onto every cluster's mean and basis vectors once,
+after which each pixel is a short dot product of its weights with its
+cluster's projections. The cost follows clusters times basis vectors times
+lights plus pixels times basis vectors
+*/
+float relight_cpca(const CPCAChannel &red_c, const CPCAChannel &green_c,
+	const CPCAChannel &blue_c, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	const CPCAChannel *channels[3] = {&red_c, &green_c, &blue_c};
+	const LightList *lights[3] = {&red, &green, &blue};
+	const int pixels = red_c.pixels;
+	float max_light = 0.0f;
+	
+	for (int c=0; c<3; c++) {
+		const CPCAChannel &cc = *channels[c];
+		const int rank = cc.basis + 1;
+		const size_t light_stride = (size_t)cc.clusters * rank;
+		vector<float> projection(light_stride, 0.0f);
+		for (int j=0; j<num_wavelets; j++) {
+			const float *v = &cc.vectors[(*lights[c])[j].first * light_stride];
+			float weight = (*lights[c])[j].second;
+			for (size_t n=0; n<light_stride; n++)
+				projection[n] += weight * v[n];
+		}
+		
+		const uint32_t *cluster = &cc.cluster[0];
+		const float *weights = cc.weights.empty() ? NULL : &cc.weights[0];
+		const float *proj = &projection[0];
+		#pragma omp parallel for schedule(static) reduction(max:max_light)
+		for (int p=0; p<pixels; p++) {
+			const float *k = proj + cluster[p] * rank;
+			float sum = k[0];
+			for (unsigned int j=0; j<cc.basis; j++)
+				sum += weights[(size_t)p*cc.basis + j] * k[1 + j];
+			pre_image[3*p+c] += sum;
+			max_light = max(max_light, pre_image[3*p+c]);
+		}
+	}
+	return max_light;
+}
+
+/*
+Projects the chosen lights onto the right singular vectors, scales them by
+the singular values and expands the result through the left ones, so a frame
+costs rank times (lights + pixels)
+*/
+float relight_low_rank(const LowRankChannel &red_f, const LowRankChannel &green_f,
+	const LowRankChannel &blue_f, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	const LowRankChannel *channels[3] = {&red_f, &green_f, &blue_f};
+	const LightList *lights[3] = {&red, &green, &blue};
+	const int pixels = red_f.pixels;
+	float max_light = 0.0f;
+	
+	for (int c=0; c<3; c++) {
+		const LowRankChannel &f = *channels[c];
+		const int rank = f.rank;
+		vector<float> projection(rank, 0.0f);
+		for (int j=0; j<num_wavelets; j++) {
+			const float *v = &f.v[(size_t)(*lights[c])[j].first * rank];
+			float weight = (*lights[c])[j].second;
+			for (int k=0; k<rank; k++)
+				projection[k] += weight * v[k];
+		}
+		for (int k=0; k<rank; k++)
+			projection[k] *= f.s[k];
+		
+		const float *u = &f.u[0];
+		const float *proj = &projection[0];
+		#pragma omp parallel for schedule(static) reduction(max:max_light)
+		for (int p=0; p<pixels; p++) {
+			float sum = 0.0f;
+			for (int k=0; k<rank; k++)
+				sum += u[(size_t)p*rank + k] * proj[k];
+			pre_image[3*p+c] += sum;
+			max_light = max(max_light, pre_image[3*p+c]);
+		}
+	}
+	return max_light;
+}
+
+/*
+Sums every chosen light into one tile at a time. A tile's accumulator stays
+in cache while each light's part of the tile streams in as one contiguous run
+*/
+float relight_tiled(const TiledChannel &red_t, const TiledChannel &green_t,
+	const TiledChannel &blue_t, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image) {
+	const TiledChannel *channels[3] = {&red_t, &green_t, &blue_t};
+	const LightList *lights[3] = {&red, &green, &blue};
+	const int tiles = red_t.tiles_x * red_t.tiles_y;
+	float max_light = 0.0f;
+	
+	#pragma omp parallel reduction(max:max_light)
+	{
+		vector<float> acc(TILE_PIXELS);
+		#pragma omp for schedule(static)
+		for (int tile=0; tile<tiles; tile++) {
+			unsigned int x0 = (tile % red_t.tiles_x) * TILE_SIZE;
+			unsigned int y0 = (tile / red_t.tiles_x) * TILE_SIZE;
+			unsigned int w = min((unsigned int)TILE_SIZE, red_t.width - x0);
+			unsigned int h = min((unsigned int)TILE_SIZE, red_t.height - y0);
+			for (int c=0; c<3; c++) {
+				const TiledChannel &tc = *channels[c];
+				const size_t stride = tc.arena.stride;
+				const float *base = tc.arena.data + (size_t)tile*tc.num_lights*stride;
+				fill(acc.begin(), acc.end(), 0.0f);
+				for (int j=0; j<num_wavelets; j++) {
+					const float *src = base + (size_t)(*lights[c])[j].first*stride;
+					float weight = (*lights[c])[j].second;
+					for (int p=0; p<TILE_PIXELS; p++)
+						acc[p] += weight * src[p];
+				}
+				for (unsigned int y=0; y<h; y++) {
+					float *row = pre_image + 3*((size_t)(y0 + y)*tc.width + x0) + c;
+					for (unsigned int x=0; x<w; x++) {
+						row[3*x] += acc[y*TILE_SIZE + x];
+						max_light = max(max_light, row[3*x]);
+					}
+				}
+			}
+		}
+	}
+	return max_light;
+}
+
+/*
+Adds each light's RGB column over one span of the image at a time. When the
+three lists name the same light, as after rank_shared_lights, that is a single
+contiguous stream matching the image layout; otherwise each channel reads its
+own light's column with a stride of three
+*/
+float relight_interleaved(const InterleavedColumns &cols, const LightList &red,
+	const LightList &green, const LightList &blue, int num_wavelets, float *pre_image) {
+	const int spans = (cols.pixels + QUANT_SPAN - 1) / QUANT_SPAN;
+	const float *data = cols.arena.data;
+	float max_light = 0.0f;
+	
+	#pragma omp parallel for schedule(static) reduction(max:max_light)
+	for (int n=0; n<spans; n++) {
+		size_t p0 = (size_t)n * QUANT_SPAN;
+		int width = min((size_t)QUANT_SPAN, cols.pixels - p0);
+		float *out = pre_image + 3*p0;
+		for (int j=0; j<num_wavelets; j++) {
+			float r_weight = red[j].second;
+			float g_weight = green[j].second;
+			float b_weight = blue[j].second;
+			if (red[j].first == green[j].first && red[j].first == blue[j].first) {
+				const float *col = data + red[j].first*cols.arena.stride + 3*p0;
+				for (int p=0; p<width; p++) {
+					out[3*p] += col[3*p]*r_weight;
+					out[3*p+1] += col[3*p+1]*g_weight;
+					out[3*p+2] += col[3*p+2]*b_weight;
+				}
+			} else {
+				const float *r_col = data + red[j].first*cols.arena.stride + 3*p0;
+				const float *g_col = data + green[j].first*cols.arena.stride + 3*p0;
+				const float *b_col = data + blue[j].first*cols.arena.stride + 3*p0;
+				for (int p=0; p<width; p++) {
+					out[3*p] += r_col[3*p]*r_weight;
+					out[3*p+1] += g_col[3*p+1]*g_weight;
+					out[3*p+2] += b_col[3*p+2]*b_weight;
+				}
+			}
+		}
+		for (int k=0; k<3*width; k++)
+			max_light = max(max_light, out[k]);
+	}
+	return max_light;
+}
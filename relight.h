@@ -0,0 +1,51 @@
+#include <vector>
+#include <utility>
+
+#include "transport.h"
+#include "sparse.h"
+#include "quantize.h"
+#include "cpca.h"
+#include "svd.h"
+#include "tiled.h"
+#include "interleaved.h"
+
+#ifndef __INCLUDERELIGHT
+#define __INCLUDERELIGHT
+
+/* Wavelet lights of one channel sorted by importance, (light, coefficient) */
+typedef std::vector< std::pair<int,float> > LightList;
+
+/* Luminance of linear Rec. 709 red, green and blue, for ranking lights across channels */
+const float LUMINANCE_RED = 0.2126f;
+const float LUMINANCE_GREEN = 0.7152f;
+const float LUMINANCE_BLUE = 0.0722f;
+
+void rank_shared_lights(const Transport &t, LightList &red, LightList &green, LightList &blue);
+
+float relight_dense(const Transport &t, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_sparse_rows(const SparseRows &red_rows, const SparseRows &green_rows,
+	const SparseRows &blue_rows, unsigned int num_lights, const LightList &red,
+	const LightList &green, const LightList &blue, int num_wavelets, float *pre_image);
+float relight_sparse_columns(const SparseColumns &red_cols, const SparseColumns &green_cols,
+	const SparseColumns &blue_cols, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, size_t pixels, float *pre_image);
+float relight_quantized(const QuantizedColumns &red_q, const QuantizedColumns &green_q,
+	const QuantizedColumns &blue_q, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_half(const HalfColumns &red_h, const HalfColumns &green_h,
+	const HalfColumns &blue_h, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_cpca(const CPCAChannel &red_c, const CPCAChannel &green_c,
+	const CPCAChannel &blue_c, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_low_rank(const LowRankChannel &red_f, const LowRankChannel &green_f,
+	const LowRankChannel &blue_f, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_tiled(const TiledChannel &red_t, const TiledChannel &green_t,
+	const TiledChannel &blue_t, const LightList &red, const LightList &green,
+	const LightList &blue, int num_wavelets, float *pre_image);
+float relight_interleaved(const InterleavedColumns &cols, const LightList &red,
+	const LightList &green, const LightList &blue, int num_wavelets, float *pre_image);
+
+#endif
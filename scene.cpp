@@ -0,0 +1,136 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <glob.h>
+
+#include "scene.h"
+
+using namespace std;
+
+static bool is_power_of_two(unsigned int n) {
+	return n > 0 && (n & (n - 1)) == 0;
+}
+
+/* Reads the manifest at 'path', exits with a message if it is malformed */
+static void read_manifest(Scene &scene, const string &path, ifstream &in) {
+	scene.env_resolution = 0;
+	string line;
+	int line_number = 0;
+	while (getline(in, line)) {
+		line_number++;
+		istringstream fields(line);
+		string first;
+		if (!(fields >> first) || first[0] == '#') continue;
+		
+		if (first == "resolution") {
+			fields >> scene.env_resolution;
+			if (!is_power_of_two(scene.env_resolution) || !scene.files.empty()) {
+				cout << path << ":" << line_number
+				<< ": resolution must be a power of two and come first" << endl;
+				exit(1);
+			}
+			scene.files.assign(6*scene.env_resolution*scene.env_resolution, "");
+			continue;
+		}
+		
+		if (first == "basis") {
+			string name;
+			fields >> name;
+			scene.wavelet.basis = wavelet_basis(name.c_str());
+			if (scene.wavelet.basis < 0) {
+				cout << path << ":" << line_number << ": unknown basis '" << name
+				<< "', expected haar, d4 or cdf97" << endl;
+				exit(1);
+			}
+			continue;
+		}
+		
+		if (first == "decomposition") {
+			string name;
+			fields >> name;
+			scene.wavelet.decomposition = decomposition_type(name.c_str());
+			if (scene.wavelet.decomposition < 0) {
+				cout << path << ":" << line_number << ": unknown decomposition '" << name
+				<< "', expected nonstandard or standard" << endl;
+				exit(1);
+			}
+			continue;
+		}
+		
+		unsigned int res = scene.env_resolution;
+		int face = atoi(first.c_str());
+		int u, v;
+		string name;
+		if (res == 0 || !(fields >> u >> v) || !getline(fields >> ws, name)
+			|| face < 0 || face >= 6 || u < 0 || u >= (int)res || v < 0 || v >= (int)res) {
+			cout << path << ":" << line_number << ": expected '<face> <u> <v> <image>'"
+			<< " with face < 6 and u, v < resolution" << endl;
+			exit(1);
+		}
+		
+		size_t light = face*res*res + v*res + u;
+		scene.files[light] = name[0] == '/' ? name : scene.folder + "/" + name;
+	}
+	
+	if (scene.env_resolution == 0) {
+		cout << path << ": missing 'resolution' line" << endl;
+		exit(1);
+	}
+}
+
+/*
+Numbers the folder's images in sorted order, as the renderer wrote them.
+Uses the PNGs, or the float images if there are none
+*/
+static void glob_images(Scene &scene) {
+	const char *patterns[] = {"/*.png", "/*.pfm", "/*.raw"};
+	vector<string> names;
+	for (int p=0; p<3 && names.empty(); p++) {
+		glob_t gl;
+		string pattern = scene.folder + patterns[p];
+		if (glob(pattern.c_str(), 0, NULL, &gl) == 0) {
+			for (size_t i=0; i<gl.gl_pathc; i++)
+				names.push_back(gl.gl_pathv[i]);
+		}
+		globfree(&gl);
+	}
+	
+	scene.env_resolution = sqrt(names.size() / 6.0);
+	size_t num_lights = 6*scene.env_resolution*scene.env_resolution;
+	if (!is_power_of_two(scene.env_resolution)) {
+		cout << "Found " << names.size() << " images in " << scene.folder
+		<< ", which is not a cubemap with a power of two resolution."
+		<< " Add a " << SCENE_MANIFEST << " to say which light each image is" << endl;
+		exit(1);
+	}
+	if (names.size() != num_lights) {
+		clog << "Using the first " << num_lights << " of " << names.size()
+		<< " images in " << scene.folder << "\n";
+	}
+	scene.files.assign(names.begin(), names.begin() + num_lights);
+}
+
+/* Finds the image for every light of the scene in 'folder' */
+void load_scene(Scene &scene, const char *folder) {
+	scene.folder = folder;
+	scene.wavelet.basis = WAVELET_HAAR;
+	scene.wavelet.decomposition = NONSTANDARD;
+	scene.files.clear();
+	
+	string path = scene.folder + "/" + SCENE_MANIFEST;
+	ifstream in(path.c_str());
+	if (in.is_open())
+		read_manifest(scene, path, in);
+	else
+		glob_images(scene);
+}
+
+/* Number of lights that have an image */
+int rendered_lights(const Scene &scene) {
+	int count = 0;
+	for (size_t i=0; i<scene.files.size(); i++)
+		if (!scene.files[i].empty()) count++;
+	return count;
+}
@@ -0,0 +1,35 @@
+#include <string>
+#include <vector>
+
+#include "wavelet.h"
+
+#ifndef __INCLUDESCENE
+#define __INCLUDESCENE
+
+/*
+Which image lights each column of the transport matrix.
+Light (face, u, v) of the cubemap is column face*res*res + v*res + u, the same
+order the environment vector is built in. Lights without an image have an
+empty file name and stay black.
+
+A scene folder can describe its lights in a 'lights.txt' manifest:
+    resolution <texels per cube face side>
+    basis <haar, d4 or cdf97>   (optional, the wavelet basis, haar by default)
+    decomposition <nonstandard or standard>   (optional, nonstandard by default)
+    <face> <u> <v> <image path, relative to the folder>
+Lines starting with '#' are ignored. Without a manifest the folder's *.png
+files (or *.pfm, or *.raw float images) are used in sorted order
+*/
+#define SCENE_MANIFEST "lights.txt"
+
+struct Scene {
+	std::string folder;
+	unsigned int env_resolution;
+	Wavelet wavelet;
+	std::vector<std::string> files;
+};
+
+void load_scene(Scene &scene, const char *folder);
+int rendered_lights(const Scene &scene);
+
+#endif
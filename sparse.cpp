@@ -0,0 +1,165 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "omp.h"
+
+#include "sparse.h"
+
+using namespace std;
+
+/* Pixel rows thresholded per parallel step, bounds the temporary entries */
+const int SPARSE_CHUNK = 64*PIXEL_BLOCK;
+
+static bool larger_magnitude(const pair<float,uint32_t> &a, const pair<float,uint32_t> &b) {
+	return fabsf(a.first) > fabsf(b.first);
+}
+
+static bool by_light(const pair<float,uint32_t> &a, const pair<float,uint32_t> &b) {
+	return a.second < b.second;
+}
+
+/*
+Thresholds the pixel rows of one channel. A row keeps the coefficients whose
+magnitude is at least 'epsilon', and of those only the 'top_k' largest when
+top_k > 0. Entries stay in light order within a row
+*/
+static void threshold_channel(float **cols, unsigned int num_lights, size_t pixels,
+	int top_k, float epsilon, SparseRows &rows) {
+	rows.row_start.assign(1, 0);
+	rows.light.clear();
+	rows.value.clear();
+	
+	const int blocks_per_chunk = SPARSE_CHUNK / PIXEL_BLOCK;
+	vector< vector<uint32_t> > block_lights(blocks_per_chunk);
+	vector< vector<float> > block_values(blocks_per_chunk);
+	vector< vector<uint32_t> > block_counts(blocks_per_chunk);
+	
+	for (size_t chunk=0; chunk<pixels; chunk+=SPARSE_CHUNK) {
+		#pragma omp parallel
+		{
+			vector< vector<float> > block(PIXEL_BLOCK, vector<float>(num_lights));
+			vector< pair<float,uint32_t> > kept;
+			
+			#pragma omp for schedule(static)
+			for (int b=0; b<blocks_per_chunk; b++) {
+				block_lights[b].clear();
+				block_values[b].clear();
+				block_counts[b].clear();
+				size_t start = chunk + (size_t)b*PIXEL_BLOCK;
+				if (start >= pixels) continue;
+				int width = min((size_t)PIXEL_BLOCK, pixels - start);
+				
+				/* Transpose in TILE x TILE pieces so both sides stay in cache */
+				for (unsigned int i0=0; i0<num_lights; i0+=TRANSPOSE_TILE) {
+					unsigned int i1 = min(i0 + TRANSPOSE_TILE, num_lights);
+					for (int p=0; p<width; p++)
+						for (unsigned int i=i0; i<i1; i++)
+							block[p][i] = cols[i][start + p];
+				}
+				
+				for (int p=0; p<width; p++) {
+					kept.clear();
+					for (unsigned int i=0; i<num_lights; i++) {
+						if (block[p][i] != 0.0f && fabsf(block[p][i]) >= epsilon)
+							kept.push_back(make_pair(block[p][i], i));
+					}
+					if (top_k > 0 && kept.size() > (size_t)top_k) {
+						nth_element(kept.begin(), kept.begin() + top_k, kept.end(), larger_magnitude);
+						kept.resize(top_k);
+						sort(kept.begin(), kept.end(), by_light);
+					}
+					block_counts[b].push_back(kept.size());
+					for (unsigned int k=0; k<kept.size(); k++) {
+						block_lights[b].push_back(kept[k].second);
+						block_values[b].push_back(kept[k].first);
+					}
+				}
+			}
+		}
+		
+		/* Append the blocks in pixel order so the result is deterministic */
+		for (int b=0; b<blocks_per_chunk; b++) {
+			for (unsigned int p=0; p<block_counts[b].size(); p++)
+				rows.row_start.push_back(rows.row_start.back() + block_counts[b][p]);
+			rows.light.insert(rows.light.end(), block_lights[b].begin(), block_lights[b].end());
+			rows.value.insert(rows.value.end(), block_values[b].begin(), block_values[b].end());
+		}
+	}
+}
+
+/*
+Builds the thresholded rows of every channel from the dense (wavelet domain)
+columns of 't', and reports how much of the matrix they kept
+*/
+void build_sparse_rows(const Transport &t, int top_k, float epsilon,
+	SparseRows &red, SparseRows &green, SparseRows &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	clog << "Thresholding transport rows (top " << top_k << ", epsilon " << epsilon << ")\n";
+	threshold_channel(t.red, t.num_lights, pixels, top_k, epsilon, red);
+	threshold_channel(t.green, t.num_lights, pixels, top_k, epsilon, green);
+	threshold_channel(t.blue, t.num_lights, pixels, top_k, epsilon, blue);
+	
+	size_t kept = red.value.size() + green.value.size() + blue.value.size();
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double sparse_bytes = kept * (sizeof(uint32_t) + sizeof(float))
+		+ 3.0 * (pixels + 1) * sizeof(uint32_t);
+	clog << "Kept " << 100.0 * kept / (3.0 * pixels * t.num_lights) << "% of the coefficients, "
+		<< sparse_bytes / (1 << 20) << " MB instead of " << dense_bytes / (1 << 20) << " MB ("
+		<< (dense_bytes - sparse_bytes) / (1 << 20) << " MB saved)\n";
+}
+
+static bool kept_coefficient(float value, float epsilon) {
+	return value != 0.0f && fabsf(value) >= epsilon;
+}
+
+/* Compresses the columns of one channel, counting each first to size the arrays */
+static void compress_channel(float **cols, unsigned int num_lights, size_t pixels,
+	float epsilon, SparseColumns &out) {
+	out.col_start.assign(num_lights + 1, 0);
+	
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int i=0; i<(int)num_lights; i++) {
+		uint32_t count = 0;
+		for (size_t p=0; p<pixels; p++)
+			count += kept_coefficient(cols[i][p], epsilon);
+		out.col_start[i+1] = count;
+	}
+	for (unsigned int i=0; i<num_lights; i++)
+		out.col_start[i+1] += out.col_start[i];
+	
+	out.pixel.resize(out.col_start[num_lights]);
+	out.value.resize(out.col_start[num_lights]);
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int i=0; i<(int)num_lights; i++) {
+		uint32_t k = out.col_start[i];
+		for (size_t p=0; p<pixels; p++) {
+			if (kept_coefficient(cols[i][p], epsilon)) {
+				out.pixel[k] = p;
+				out.value[k] = cols[i][p];
+				k++;
+			}
+		}
+	}
+}
+
+/*
+Builds the compressed columns of every channel from the dense (wavelet domain)
+columns of 't', keeping the coefficients of magnitude at least 'epsilon'
+*/
+void build_sparse_columns(const Transport &t, float epsilon,
+	SparseColumns &red, SparseColumns &green, SparseColumns &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	clog << "Compressing transport columns (epsilon " << epsilon << ")\n";
+	compress_channel(t.red, t.num_lights, pixels, epsilon, red);
+	compress_channel(t.green, t.num_lights, pixels, epsilon, green);
+	compress_channel(t.blue, t.num_lights, pixels, epsilon, blue);
+	
+	size_t kept = red.value.size() + green.value.size() + blue.value.size();
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double sparse_bytes = kept * (sizeof(uint32_t) + sizeof(float))
+		+ 3.0 * (t.num_lights + 1) * sizeof(uint32_t);
+	clog << "Kept " << 100.0 * kept / (3.0 * pixels * t.num_lights) << "% of the coefficients, "
+		<< sparse_bytes / (1 << 20) << " MB instead of " << dense_bytes / (1 << 20) << " MB ("
+		<< (dense_bytes - sparse_bytes) / (1 << 20) << " MB saved)\n";
+}
@@ -0,0 +1,36 @@
+#include <stdint.h>
+#include <vector>
+
+#include "transport.h"
+
+#ifndef __INCLUDESPARSE
+#define __INCLUDESPARSE
+
+/*
+One channel of the transport stored by pixel rows, keeping only each row's
+largest wavelet coefficients (Ng et al. 2003). The entries of pixel p are
+light[row_start[p] .. row_start[p+1]) and the matching values
+*/
+struct SparseRows {
+	std::vector<uint32_t> row_start;
+	std::vector<uint32_t> light;
+	std::vector<float> value;
+};
+
+/*
+One channel stored by light columns (CSC), keeping the coefficients of every
+column at or above a threshold. The entries of light i are
+pixel[col_start[i] .. col_start[i+1]) in pixel order, and the matching values
+*/
+struct SparseColumns {
+	std::vector<uint32_t> col_start;
+	std::vector<uint32_t> pixel;
+	std::vector<float> value;
+};
+
+void build_sparse_rows(const Transport &t, int top_k, float epsilon,
+	SparseRows &red, SparseRows &green, SparseRows &blue);
+void build_sparse_columns(const Transport &t, float epsilon,
+	SparseColumns &red, SparseColumns &green, SparseColumns &blue);
+
+#endif
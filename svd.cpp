@@ -0,0 +1,312 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "omp.h"
+
+#include "svd.h"
+
+using namespace std;
+
+static const char SVD_MAGIC[8] = {'P','R','T','S','V','D','\0','\0'};
+static const uint32_t SVD_VERSION = 1;
+
+/* Pixels of Y = T*X accumulated together while walking the columns */
+static const int SVD_BLOCK = 256;
+
+/* Side file next to the transport cache, see CPCAHeader */
+struct SVDHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t rank;
+	CacheKey key;
+	uint64_t fingerprint;
+};
+
+/*
+Randomized SVD of one channel, touching the columns only in whole passes so
+they can stream from a mapped cache. Every matrix is row major:
+T is pixels x lights (the columns), Y and Q pixels x l, Z lights x l
+*/
+
+/* Y = T*X, where X is lights x l */
+static void multiply_columns(float **cols, unsigned int num_lights, size_t pixels,
+	const vector<float> &x, int l, vector<float> &y) {
+	y.assign(pixels * l, 0.0f);
+	const int blocks = (pixels + SVD_BLOCK - 1) / SVD_BLOCK;
+	#pragma omp parallel for schedule(static)
+	for (int b=0; b<blocks; b++) {
+		size_t p0 = (size_t)b * SVD_BLOCK;
+		int width = min((size_t)SVD_BLOCK, pixels - p0);
+		for (unsigned int i=0; i<num_lights; i++) {
+			const float *col = cols[i] + p0;
+			const float *xi = &x[(size_t)i*l];
+			for (int p=0; p<width; p++) {
+				if (col[p] == 0.0f) continue;
+				float *yp = &y[(p0 + p)*l];
+				for (int j=0; j<l; j++) yp[j] += col[p] * xi[j];
+			}
+		}
+	}
+}
+
+/* Z = T^T*Y, where Y is pixels x l */
+static void multiply_transposed(float **cols, unsigned int num_lights, size_t pixels,
+	const vector<float> &y, int l, vector<float> &z) {
+	z.assign((size_t)num_lights * l, 0.0f);
+	#pragma omp parallel
+	{
+		vector<double> sum(l);
+		#pragma omp for schedule(static)
+		for (int i=0; i<(int)num_lights; i++) {
+			fill(sum.begin(), sum.end(), 0.0);
+			for (size_t p=0; p<pixels; p++) {
+				if (cols[i][p] == 0.0f) continue;
+				const float *yp = &y[p*l];
+				for (int j=0; j<l; j++) sum[j] += cols[i][p] * yp[j];
+			}
+			for (int j=0; j<l; j++) z[(size_t)i*l + j] = sum[j];
+		}
+	}
+}
+
+/* Orthonormalizes the l columns of the rows x l matrix 'a' by modified Gram-Schmidt */
+static void orthonormalize(vector<float> &a, size_t rows, int l) {
+	for (int j=0; j<l; j++) {
+		for (int k=0; k<j; k++) {
+			double dot = 0.0;
+			#pragma omp parallel for schedule(static) reduction(+:dot)
+			for (long r=0; r<(long)rows; r++) dot += (double)a[r*l + j] * a[r*l + k];
+			#pragma omp parallel for schedule(static)
+			for (long r=0; r<(long)rows; r++) a[r*l + j] -= dot * a[r*l + k];
+		}
+		double norm = 0.0;
+		#pragma omp parallel for schedule(static) reduction(+:norm)
+		for (long r=0; r<(long)rows; r++) norm += (double)a[r*l + j] * a[r*l + j];
+		float scale = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0f;
+		#pragma omp parallel for schedule(static)
+		for (long r=0; r<(long)rows; r++) a[r*l + j] *= scale;
+	}
+}
+
+/*
+Eigenvectors of the symmetric n x n matrix 'a' by cyclic Jacobi rotations.
+On return the diagonal of 'a' holds the eigenvalues and column j of 'vectors'
+the matching eigenvector
+*/
+static void jacobi_eigen(vector<double> &a, int n, vector<double> &vectors) {
+	vectors.assign(n * n, 0.0);
+	for (int i=0; i<n; i++) vectors[i*n + i] = 1.0;
+	
+	for (int sweep=0; sweep<50; sweep++) {
+		double off = 0.0, diagonal = 0.0;
+		for (int i=0; i<n; i++) {
+			diagonal += a[i*n + i] * a[i*n + i];
+			for (int j=i+1; j<n; j++) off += a[i*n + j] * a[i*n + j];
+		}
+		if (off <= 1e-24 * diagonal) break;
+	
+		for (int p=0; p<n; p++) {
+			for (int q=p+1; q<n; q++) {
+				double apq = a[p*n + q];
+				if (apq == 0.0) continue;
+				double theta = (a[q*n + q] - a[p*n + p]) / (2.0 * apq);
+				double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+				double c = 1.0 / sqrt(t*t + 1.0);
+				double s = t * c;
+				for (int k=0; k<n; k++) {
+					double akp = a[k*n + p], akq = a[k*n + q];
+					a[k*n + p] = c*akp - s*akq;
+					a[k*n + q] = s*akp + c*akq;
+				}
+				for (int k=0; k<n; k++) {
+					double apk = a[p*n + k], aqk = a[q*n + k];
+					a[p*n + k] = c*apk - s*aqk;
+					a[q*n + k] = s*apk + c*aqk;
+				}
+				for (int k=0; k<n; k++) {
+					double vkp = vectors[k*n + p], vkq = vectors[k*n + q];
+					vectors[k*n + p] = c*vkp - s*vkq;
+					vectors[k*n + q] = s*vkp + c*vkq;
+				}
+			}
+		}
+	}
+}
+
+/* Factors one channel, returning the squared singular values it kept */
+static double factor_channel(float **cols, unsigned int num_lights, size_t pixels,
+	int rank, LowRankChannel &out) {
+	const int l = min((int)num_lights, rank + SVD_OVERSAMPLE);
+	
+	/* Gaussian test matrix from a fixed seed so the result is repeatable */
+	vector<float> x((size_t)num_lights * l);
+	uint32_t state = 12345;
+	for (size_t n=0; n<x.size(); n+=2) {
+		state = state * 1664525u + 1013904223u;
+		double u1 = ((state >> 8) + 0.5) / (1 << 24);
+		state = state * 1664525u + 1013904223u;
+		double u2 = ((state >> 8) + 0.5) / (1 << 24);
+		double radius = sqrt(-2.0 * log(u1));
+		x[n] = radius * cos(2.0 * M_PI * u2);
+		if (n+1 < x.size()) x[n+1] = radius * sin(2.0 * M_PI * u2);
+	}
+	
+	/* Range of T, sharpened by power iterations: Q = orth((T T^T)^q T X) */
+	vector<float> q;
+	multiply_columns(cols, num_lights, pixels, x, l, q);
+	orthonormalize(q, pixels, l);
+	for (int n=0; n<SVD_POWER_ITERATIONS; n++) {
+		multiply_transposed(cols, num_lights, pixels, q, l, x);
+		orthonormalize(x, num_lights, l);
+		multiply_columns(cols, num_lights, pixels, x, l, q);
+		orthonormalize(q, pixels, l);
+	}
+	
+	/* B^T = T^T Q is lights x l, and B B^T = W diag(s^2) W^T */
+	vector<float> bt;
+	multiply_transposed(cols, num_lights, pixels, q, l, bt);
+	vector<double> gram(l * l, 0.0), w;
+	for (unsigned int i=0; i<num_lights; i++)
+		for (int a=0; a<l; a++)
+			for (int b=0; b<l; b++)
+				gram[a*l + b] += (double)bt[(size_t)i*l + a] * bt[(size_t)i*l + b];
+	jacobi_eigen(gram, l, w);
+	
+	vector<int> order(l);
+	for (int j=0; j<l; j++) order[j] = j;
+	for (int j=0; j<l; j++)
+		for (int k=j+1; k<l; k++)
+			if (gram[order[k]*l + order[k]] > gram[order[j]*l + order[j]]) swap(order[j], order[k]);
+	
+	/* U = Q W, V = B^T W / s */
+	out.rank = rank;
+	out.num_lights = num_lights;
+	out.pixels = pixels;
+	out.s.resize(rank);
+	out.u.assign(pixels * rank, 0.0f);
+	out.v.assign((size_t)num_lights * rank, 0.0f);
+	double kept = 0.0;
+	for (int j=0; j<rank; j++) {
+		double s2 = max(0.0, gram[order[j]*l + order[j]]);
+		out.s[j] = sqrt(s2);
+		kept += s2;
+	}
+	#pragma omp parallel for schedule(static)
+	for (long p=0; p<(long)pixels; p++)
+		for (int j=0; j<rank; j++) {
+			double sum = 0.0;
+			for (int a=0; a<l; a++) sum += q[p*l + a] * w[a*l + order[j]];
+			out.u[p*rank + j] = sum;
+		}
+	for (unsigned int i=0; i<num_lights; i++)
+		for (int j=0; j<rank; j++) {
+			if (out.s[j] == 0.0f) continue;
+			double sum = 0.0;
+			for (int a=0; a<l; a++) sum += bt[(size_t)i*l + a] * w[a*l + order[j]];
+			out.v[(size_t)i*rank + j] = sum / out.s[j];
+		}
+	return kept;
+}
+
+/*
+Factors every channel of the (wavelet domain) columns of 't' to 'rank'
+singular vectors, and reports the size and the relative error
+*/
+void build_low_rank(const Transport &t, int rank,
+	LowRankChannel &red, LowRankChannel &green, LowRankChannel &blue) {
+	size_t pixels = (size_t)t.width * t.height;
+	float **cols[3] = {t.red, t.green, t.blue};
+	const ColumnStats *stats[3] = {&t.red_stats, &t.green_stats, &t.blue_stats};
+	LowRankChannel *out[3] = {&red, &green, &blue};
+	rank = max(1, min(rank, (int)t.num_lights));
+	
+	double kept = 0.0, energy = 0.0;
+	for (int c=0; c<3; c++) {
+		clog << "Randomized SVD of channel " << c << " (rank " << rank << ")\r";
+		kept += factor_channel(cols[c], t.num_lights, pixels, rank, *out[c]);
+		for (unsigned int i=0; i<t.num_lights; i++)
+			energy += (double)stats[c]->norm[i] * stats[c]->norm[i];
+	}
+	clog << "\n";
+	
+	double dense_bytes = 3.0 * pixels * t.num_lights * sizeof(float);
+	double low_rank_bytes = 3.0 * (red.u.size() + red.s.size() + red.v.size()) * sizeof(float);
+	clog << "Rank " << red.rank << " factors are " << low_rank_bytes / (1 << 20) << " MB instead of "
+		<< dense_bytes / (1 << 20) << " MB, relative error "
+		<< sqrt(max(0.0, energy - kept) / max(energy, 1e-30)) << "\n";
+}
+
+static SVDHeader make_header(const Transport &t, const CacheKey &key, int rank) {
+	SVDHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SVD_MAGIC, sizeof(SVD_MAGIC));
+	header.version = SVD_VERSION;
+	header.rank = rank;
+	header.key = key;
+	header.fingerprint = transport_fingerprint(t);
+	return header;
+}
+
+static bool read_floats(FILE *file, vector<float> &v, size_t count) {
+	v.resize(count);
+	return fread(&v[0], sizeof(float), count, file) == count;
+}
+
+/* Reads the factors at 'path' if they were made from this transport at this rank */
+bool load_low_rank(const char *path, const Transport &t, const CacheKey &key, int rank,
+	LowRankChannel &red, LowRankChannel &green, LowRankChannel &blue) {
+	rank = max(1, min(rank, (int)t.num_lights));
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+	
+	SVDHeader header, expected = make_header(t, key, rank);
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(&header, &expected, sizeof(header)) == 0;
+	
+	size_t pixels = (size_t)t.width * t.height;
+	LowRankChannel *out[3] = {&red, &green, &blue};
+	for (int c=0; c<3 && ok; c++) {
+		out[c]->rank = rank;
+		out[c]->num_lights = t.num_lights;
+		out[c]->pixels = pixels;
+		ok = read_floats(file, out[c]->u, pixels * rank)
+			&& read_floats(file, out[c]->s, rank)
+			&& read_floats(file, out[c]->v, (size_t)t.num_lights * rank);
+	}
+	fclose(file);
+	return ok;
+}
+
+/* Writes the factors next to the transport cache, through a temporary file */
+bool save_low_rank(const char *path, const Transport &t, const CacheKey &key,
+	const LowRankChannel &red, const LowRankChannel &green, const LowRankChannel &blue) {
+	string tmp_path = string(path) + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file) {
+		clog << "Could not write " << path << "\n";
+		return false;
+	}
+	
+	SVDHeader header = make_header(t, key, red.rank);
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	const LowRankChannel *channels[3] = {&red, &green, &blue};
+	for (int c=0; c<3 && ok; c++) {
+		const LowRankChannel &ch = *channels[c];
+		ok = fwrite(&ch.u[0], sizeof(float), ch.u.size(), file) == ch.u.size()
+			&& fwrite(&ch.s[0], sizeof(float), ch.s.size(), file) == ch.s.size()
+			&& fwrite(&ch.v[0], sizeof(float), ch.v.size(), file) == ch.v.size();
+	}
+	ok = (fclose(file) == 0) && ok;
+	
+	if (!ok || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		clog << "Could not write " << path << "\n";
+		return false;
+	}
+	clog << "Saved low rank factors " << path << "\n";
+	return true;
+}
@@ -0,0 +1,38 @@
+#include <cstddef>
+#include <vector>
+
+#include "transport.h"
+#include "cache.h"
+
+#ifndef __INCLUDESVD
+#define __INCLUDESVD
+
+/*
+Rank 'rank' factorization T ~ U S V^T of one channel of the transport.
+u[p*rank + j] is pixel p of left singular vector j and v[i*rank + j] is
+light i of right singular vector j, so both are read a row at a time
+*/
+struct LowRankChannel {
+	unsigned int rank;
+	unsigned int num_lights;
+	size_t pixels;
+	std::vector<float> u;
+	std::vector<float> s;
+	std::vector<float> v;
+};
+
+/*
+Extra random directions sampled beyond the rank, and the power iterations
+that sharpen them (Halko et al. 2011)
+*/
+const int SVD_OVERSAMPLE = 10;
+const int SVD_POWER_ITERATIONS = 2;
+
+void build_low_rank(const Transport &t, int rank,
+	LowRankChannel &red, LowRankChannel &green, LowRankChannel &blue);
+bool load_low_rank(const char *path, const Transport &t, const CacheKey &key, int rank,
+	LowRankChannel &red, LowRankChannel &green, LowRankChannel &blue);
+bool save_low_rank(const char *path, const Transport &t, const CacheKey &key,
+	const LowRankChannel &red, const LowRankChannel &green, const LowRankChannel &blue);
+
+#endif
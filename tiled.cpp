@@ -0,0 +1,55 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include "omp.h"
+
+#include "tiled.h"
+
+using namespace std;
+
+static void tile_channel(float **cols, unsigned int width, unsigned int height,
+	unsigned int num_lights, TiledChannel &out) {
+	out.width = width;
+	out.height = height;
+	out.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	out.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	out.num_lights = num_lights;
+	const int tiles = out.tiles_x * out.tiles_y;
+	allocate_arena(out.arena, TILE_PIXELS, (size_t)tiles * num_lights);
+	
+	#pragma omp parallel for schedule(static)
+	for (int i=0; i<(int)num_lights; i++) {
+		for (int tile=0; tile<tiles; tile++) {
+			unsigned int x0 = (tile % out.tiles_x) * TILE_SIZE;
+			unsigned int y0 = (tile / out.tiles_x) * TILE_SIZE;
+			unsigned int w = min((unsigned int)TILE_SIZE, width - x0);
+			unsigned int h = min((unsigned int)TILE_SIZE, height - y0);
+			float *dst = out.arena.data + ((size_t)tile*num_lights + i)*out.arena.stride;
+			if (w < (unsigned int)TILE_SIZE || h < (unsigned int)TILE_SIZE)
+				memset(dst, 0, TILE_PIXELS*sizeof(float));
+			for (unsigned int y=0; y<h; y++)
+				memcpy(dst + y*TILE_SIZE, cols[i] + (size_t)(y0 + y)*width + x0, w*sizeof(float));
+		}
+	}
+}
+
+/*
+Copies the dense columns of 't' into the tiled layout. With 'release' each
+channel's columns are given back as soon as they are tiled, so the copy
+never needs a second full transport; they read as zero afterwards
+*/
+void build_tiled_channels(Transport &t, bool release,
+	TiledChannel &red, TiledChannel &green, TiledChannel &blue) {
+	clog << "Tiling transport into " << TILE_SIZE << "x" << TILE_SIZE << " pixel tiles\n";
+	float **cols[3] = {t.red, t.green, t.blue};
+	TiledChannel *out[3] = {&red, &green, &blue};
+	for (int c=0; c<3; c++) {
+		tile_channel(cols[c], t.width, t.height, t.num_lights, *out[c]);
+		if (release)
+			release_column_pages(t, c, 0, t.num_lights);
+	}
+}
+
+void free_tiled_channel(TiledChannel &channel) {
+	free_arena(channel.arena);
+}
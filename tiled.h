@@ -0,0 +1,30 @@
+#include "transport.h"
+
+#ifndef __INCLUDETILED
+#define __INCLUDETILED
+
+/* Side of the square pixel tiles of a TiledChannel */
+const int TILE_SIZE = 64;
+const int TILE_PIXELS = TILE_SIZE*TILE_SIZE;
+
+/*
+One channel of the transport cut into TILE_SIZE x TILE_SIZE pixel tiles, with
+every light's part of a tile stored back to back as one arena column. Pixel
+(x, y) of tile tile_y*tiles_x + tile_x for light i is
+arena.data[(tile*num_lights + i)*arena.stride + y*TILE_SIZE + x]. Tiles
+reaching past the image edge are zero padded
+*/
+struct TiledChannel {
+	unsigned int width;
+	unsigned int height;
+	unsigned int tiles_x;
+	unsigned int tiles_y;
+	unsigned int num_lights;
+	ColumnArena arena;
+};
+
+void build_tiled_channels(Transport &t, bool release,
+	TiledChannel &red, TiledChannel &green, TiledChannel &blue);
+void free_tiled_channel(TiledChannel &channel);
+
+#endif
@@ -0,0 +1,454 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "omp.h"
+
+#include "transport.h"
+#include "wavelet.h"
+#include "image.h"
+
+using namespace std;
+
+/* Huge page size to round large arenas up to */
+static const size_t HUGE_PAGE = 2 << 20;
+
+/*
+Allocates an arena of 'columns' columns of 'floats' floats each. Arenas of at
+least a huge page are mapped and offered to the kernel as transparent huge
+pages, which cuts the TLB misses of walking thousands of columns. Smaller
+ones, or systems without the advice, fall back to an aligned heap block
+*/
+void allocate_arena(ColumnArena &arena, size_t floats, size_t columns) {
+	arena.stride = column_stride(floats);
+	arena.bytes = columns * arena.stride * sizeof(float);
+	arena.mapped = false;
+	arena.data = NULL;
+	
+	#ifdef MADV_HUGEPAGE
+	if (arena.bytes >= HUGE_PAGE) {
+		size_t bytes = (arena.bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+		void *data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, bytes, MADV_HUGEPAGE);
+			arena.data = (float*) data;
+			arena.bytes = bytes;
+			arena.mapped = true;
+			return;
+		}
+	}
+	#endif
+	
+	void *data = NULL;
+	if (posix_memalign(&data, COLUMN_ALIGNMENT, arena.bytes) != 0) {
+		cout << "Could not allocate " << (arena.bytes >> 20) << " MB for the transport" << endl;
+		exit(1);
+	}
+	arena.data = (float*) data;
+}
+
+/* Points the columns of 't' at the arena laid out from 'data' */
+void point_columns(Transport &t, float *data, size_t stride) {
+	t.arena.data = data;
+	t.arena.stride = stride;
+	t.red = new float*[t.num_lights];
+	t.green = new float*[t.num_lights];
+	t.blue = new float*[t.num_lights];
+	for (unsigned int i=0; i<t.num_lights; i++) {
+		t.red[i] = data + (size_t)i*stride;
+		t.green[i] = data + ((size_t)t.num_lights + i)*stride;
+		t.blue[i] = data + (2*(size_t)t.num_lights + i)*stride;
+	}
+}
+
+void allocate_transport(Transport &t, unsigned int width, unsigned int height, unsigned int num_lights) {
+	t.width = width;
+	t.height = height;
+	t.num_lights = num_lights;
+	t.mapping = NULL;
+	t.mapping_size = 0;
+	
+	size_t pixels = (size_t)width*height;
+	allocate_arena(t.arena, pixels, 3*(size_t)num_lights);
+	point_columns(t, t.arena.data, t.arena.stride);
+	
+	/* Zero the padding so saved caches do not depend on the allocator */
+	for (size_t i=0; i<3*num_lights && t.arena.stride > pixels; i++)
+		memset(t.arena.data + i*t.arena.stride + pixels, 0, (t.arena.stride - pixels)*sizeof(float));
+}
+
+/* Frees an arena from allocate_arena */
+void free_arena(ColumnArena &arena) {
+	if (arena.mapped)
+		munmap(arena.data, arena.bytes);
+	else
+		free(arena.data);
+	arena.data = NULL;
+	arena.bytes = 0;
+}
+
+ChannelView channel_view(const Transport &t, int channel) {
+	ChannelView view;
+	view.data = t.arena.data + (size_t)channel*t.num_lights*t.arena.stride;
+	view.stride = t.arena.stride;
+	return view;
+}
+
+/*
+Drops the dense columns once another representation has been built from them,
+the dimensions and per-column statistics stay available
+*/
+void release_columns(Transport &t) {
+	if (!t.red) return;
+	if (t.mapping)
+		munmap(t.mapping, t.mapping_size);
+	else
+		free_arena(t.arena);
+	delete [] t.red;
+	delete [] t.green;
+	delete [] t.blue;
+	t.red = t.green = t.blue = NULL;
+	t.arena.data = NULL;
+	t.arena.bytes = 0;
+	t.mapping = NULL;
+	t.mapping_size = 0;
+}
+
+/*
+Hands the pages under columns first..first+count-1 of 'channel' back to the
+system once they have been copied into another layout, so the copy does not
+need a second full transport. Only mapped arenas give pages back; a mapped
+cache is clean page cache already and a heap block waits for release_columns.
+The released columns read as zero
+*/
+void release_column_pages(Transport &t, int channel, unsigned int first, unsigned int count) {
+	#ifdef MADV_DONTNEED
+	if (!t.arena.mapped || count == 0) return;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = (size_t)(t.arena.data + ((size_t)channel*t.num_lights + first)*t.arena.stride);
+	size_t end = start + (size_t)count*t.arena.stride*sizeof(float);
+	start = (start + page - 1) / page * page;
+	end = end / page * page;
+	if (end > start)
+		madvise((void*)start, end - start, MADV_DONTNEED);
+	#endif
+}
+
+void free_transport(Transport &t) {
+	release_columns(t);
+	t.red_stats = ColumnStats();
+	t.green_stats = ColumnStats();
+	t.blue_stats = ColumnStats();
+}
+
+/*
+Decodes light 'i' of 'scene' into its planes. Lights that were never rendered
+are left black and return LIGHT_MISSING instead of failing
+*/
+unsigned load_light(const Scene &scene, int i, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue) {
+	const string &filename = scene.files[i];
+	if (filename.empty() || access(filename.c_str(), F_OK) != 0) {
+		fill(red, red + width*height, 0.0f);
+		fill(green, green + width*height, 0.0f);
+		fill(blue, blue + width*height, 0.0f);
+		return LIGHT_MISSING;
+	}
+	return decode_image_planar(filename.c_str(), width, height, red, green, blue);
+}
+
+/* Exits with a message if decoding any of the lights failed */
+void check_light_errors(const vector<unsigned> &errors, unsigned int width, unsigned int height) {
+	int missing = 0;
+	for (unsigned int i=0; i<errors.size(); i++) {
+		if (errors[i] == LIGHT_MISSING) {
+			missing++;
+		} else if (errors[i] == SIZE_MISMATCH) {
+			cout << "light " << i << " is not " << width << "x" << height
+			<< " (use -r to set the scene resolution)" << endl;
+			exit(1);
+		} else if (errors[i]) {
+			cout << "decoder error on light " << i << " " << errors[i]
+			<< ": " << image_error_text(errors[i]) << endl;
+			exit(1);
+		}
+	}
+	if (missing)
+		clog << "Skipped " << missing << " lights that were never rendered\n";
+}
+
+/*
+Red channel pixel rows of every 'stride'th pixel that some light reaches,
+untransformed. For the tools that study the transform on real scenes
+*/
+vector< vector<float> > sample_pixel_rows(const Scene &scene, unsigned int resolution,
+	unsigned int stride) {
+	const int num_files = scene.files.size();
+	size_t pixels = (size_t)resolution * resolution;
+	size_t samples = (pixels + stride - 1) / stride;
+	vector< vector<float> > rows(samples, vector<float>(num_files));
+	vector<unsigned> errors(num_files, 0);
+	
+	#pragma omp parallel
+	{
+		vector<float> red(pixels), green(pixels), blue(pixels);
+		#pragma omp for schedule(dynamic)
+		for (int i=0; i<num_files; i++) {
+			errors[i] = load_light(scene, i, resolution, resolution, &red[0], &green[0], &blue[0]);
+			for (size_t s=0; s<samples; s++)
+				rows[s][i] = red[s*stride];
+		}
+	}
+	check_light_errors(errors, resolution, resolution);
+	
+	vector< vector<float> > lit;
+	for (size_t s=0; s<samples; s++) {
+		for (int i=0; i<num_files; i++) {
+			if (rows[s][i] != 0.0f) {
+				lit.push_back(rows[s]);
+				break;
+			}
+		}
+	}
+	return lit;
+}
+
+/*
+Applies the light-dimension transform to one pixel row. Rows get the dual of
+the environment's transform, see wavelet2d_lanes
+*/
+void transform_row(vector<float> &row, const Wavelet &wavelet, vector<float> &scratch) {
+	#ifdef USEHAAR
+	wavelet2d(row, wavelet, WAVELET_DUAL, scratch);
+	#endif
+}
+
+/* transform_row on 'lanes' rows stored light major, see wavelet2d_lanes */
+void transform_band(float *band, int num_lights, int pitch, int lanes, const Wavelet &wavelet,
+	vector<float> &scratch) {
+	#ifdef USEHAAR
+	wavelet2d_lanes(band, num_lights, pitch, lanes, wavelet, WAVELET_DUAL, scratch);
+	#endif
+}
+
+void reset_stats(StatsAccumulator &stats, unsigned int num_lights) {
+	stats.pixels = 0;
+	stats.sum.assign(num_lights, 0.0);
+	stats.sum_squares.assign(num_lights, 0.0);
+	stats.max_abs.assign(num_lights, 0.0f);
+	stats.nonzeros.assign(num_lights, 0);
+}
+
+void finish_stats(const StatsAccumulator &stats, ColumnStats &out) {
+	unsigned int num_lights = stats.sum.size();
+	out.mean.resize(num_lights);
+	out.norm.resize(num_lights);
+	for (unsigned int i=0; i<num_lights; i++) {
+		out.mean[i] = stats.pixels ? stats.sum[i] / stats.pixels : 0.0;
+		out.norm[i] = sqrt(stats.sum_squares[i]);
+	}
+	out.max_abs = stats.max_abs;
+	out.nonzeros = stats.nonzeros;
+}
+
+/* Recomputes the statistics of column 'i' from scratch, after a patch */
+void column_stats(const float *col, size_t pixels, ColumnStats &stats, int i) {
+	double sum = 0.0, sum_squares = 0.0;
+	float max_abs = 0.0f;
+	uint32_t nonzeros = 0;
+	for (size_t pixel=0; pixel<pixels; pixel++) {
+		float v = col[pixel];
+		sum += v;
+		sum_squares += (double)v*v;
+		max_abs = max(max_abs, fabsf(v));
+		nonzeros += v != 0.0f;
+	}
+	stats.mean[i] = sum / pixels;
+	stats.norm[i] = sqrt(sum_squares);
+	stats.max_abs[i] = max_abs;
+	stats.nonzeros[i] = nonzeros;
+}
+
+/*
+Wavelet transforms 'count' pixel rows of the matrix whose light columns start at
+cols[0..num_lights). Each row holds one pixel's value under every light.
+Pixels are handled PIXEL_BLOCK at a time: each column's run of the block is
+copied into a light major band and the whole band is transformed at once, so
+columns are read and written in runs of PIXEL_BLOCK floats and every butterfly
+is a vector operation across the block's pixels.
+If 'stats' is given the column statistics are gathered during the write back,
+so the matrix is never swept again for them. Each block keeps its own partial
+sums, which are added up in block order to stay independent of the threads
+*/
+void transform_pixel_rows(float **cols, int num_lights, size_t count, const Wavelet &wavelet,
+	StatsAccumulator *stats) {
+	const int num_blocks = (count + PIXEL_BLOCK - 1) / PIXEL_BLOCK;
+	
+	vector<double> block_sum, block_sum_squares;
+	vector<float> block_max;
+	vector<uint32_t> block_nonzeros;
+	if (stats) {
+		block_sum.resize(STATS_CHUNK*num_lights);
+		block_sum_squares.resize(STATS_CHUNK*num_lights);
+		block_max.resize(STATS_CHUNK*num_lights);
+		block_nonzeros.resize(STATS_CHUNK*num_lights);
+	}
+	
+	for (int chunk=0; chunk<num_blocks; chunk+=STATS_CHUNK) {
+		const int chunk_end = min(chunk + STATS_CHUNK, num_blocks);
+		
+		#pragma omp parallel
+		{
+			vector<float> band((size_t)num_lights * PIXEL_BLOCK);
+			vector<float> scratch;
+			
+			#pragma omp for schedule(static)
+			for (int block=chunk; block<chunk_end; block++) {
+				size_t start = (size_t)block * PIXEL_BLOCK;
+				int width = min((size_t)PIXEL_BLOCK, count - start);
+				
+				for (int i=0; i<num_lights; i++) {
+					memcpy(&band[(size_t)i*PIXEL_BLOCK], cols[i] + start, width*sizeof(float));
+				}
+				
+				transform_band(&band[0], num_lights, PIXEL_BLOCK, width, wavelet, scratch);
+				
+				size_t partial = (size_t)(block - chunk) * num_lights;
+				for (int i=0; i<num_lights; i++) {
+					float *col = cols[i] + start;
+					memcpy(col, &band[(size_t)i*PIXEL_BLOCK], width*sizeof(float));
+					if (!stats) continue;
+					
+					double sum = 0.0, sum_squares = 0.0;
+					float max_abs = 0.0f;
+					uint32_t nonzeros = 0;
+					for (int p=0; p<width; p++) {
+						sum += col[p];
+						sum_squares += (double)col[p]*col[p];
+						max_abs = max(max_abs, fabsf(col[p]));
+						nonzeros += col[p] != 0.0f;
+					}
+					block_sum[partial + i] = sum;
+					block_sum_squares[partial + i] = sum_squares;
+					block_max[partial + i] = max_abs;
+					block_nonzeros[partial + i] = nonzeros;
+				}
+			}
+		}
+		
+		if (!stats) continue;
+		for (int block=chunk; block<chunk_end; block++) {
+			size_t partial = (size_t)(block - chunk) * num_lights;
+			for (int i=0; i<num_lights; i++) {
+				stats->sum[i] += block_sum[partial + i];
+				stats->sum_squares[i] += block_sum_squares[partial + i];
+				stats->max_abs[i] = max(stats->max_abs[i], block_max[partial + i]);
+				stats->nonzeros[i] += block_nonzeros[partial + i];
+			}
+		}
+	}
+	if (stats) stats->pixels += count;
+}
+
+/*
+Replaces light 'light' of an already transformed matrix with the
+untransformed 'values'. Each pixel row is c = H x with H = W^-T the dual
+transform, which is linear, so c becomes c + (x'_j - x_j) H e_j. The old
+value is x_j = <W e_j, c>, and W = H for the orthonormal bases. Only the
+columns where H e_j or W e_j is nonzero are read or changed, and they are
+flagged in 'touched'
+*/
+void patch_light_column(float **cols, int num_lights, size_t pixels, int light,
+	const Wavelet &wavelet,
+	const float *values, vector<char> &touched) {
+	vector<float> dual(num_lights, 0.0f);
+	dual[light] = 1.0f;
+	vector<float> primal(dual);
+	vector<float> scratch;
+	transform_row(dual, wavelet, scratch);
+	#ifdef USEHAAR
+	wavelet2d(primal, wavelet, WAVELET_FORWARD, scratch);
+	#endif
+	
+	vector<int> support;
+	for (int k=0; k<num_lights; k++) {
+		if (dual[k] != 0.0f || primal[k] != 0.0f) {
+			support.push_back(k);
+			touched[k] = 1;
+		}
+	}
+	
+	const int num_blocks = (pixels + PIXEL_BLOCK - 1) / PIXEL_BLOCK;
+	#pragma omp parallel
+	{
+		vector<float> delta(PIXEL_BLOCK);
+		
+		#pragma omp for schedule(static)
+		for (int block=0; block<num_blocks; block++) {
+			size_t start = (size_t)block * PIXEL_BLOCK;
+			int width = min((size_t)PIXEL_BLOCK, pixels - start);
+			
+			for (int p=0; p<width; p++)
+				delta[p] = values[start + p];
+			for (unsigned int s=0; s<support.size(); s++) {
+				const float g = primal[support[s]];
+				const float *col = cols[support[s]] + start;
+				for (int p=0; p<width; p++)
+					delta[p] -= g * col[p];
+			}
+			for (unsigned int s=0; s<support.size(); s++) {
+				const float h = dual[support[s]];
+				float *col = cols[support[s]] + start;
+				for (int p=0; p<width; p++)
+					col[p] += h * delta[p];
+			}
+		}
+	}
+}
+
+/* Creates the light transport matrix from the images of 'scene' */
+void build_transport_matrix(Transport &t, const Scene &scene,
+	unsigned int width, unsigned int height, int num_threads) {
+	const int num_files = scene.files.size();
+	
+	/* Allocate every slot up front so the decode threads never resize */
+	allocate_transport(t, width, height, num_files);
+	
+	if (num_threads > 0) omp_set_num_threads(num_threads);
+	
+	/*
+	Load files into matrix. Each light only writes its own slot, so the
+	result does not depend on the number of threads or their order
+	*/
+	vector<unsigned> errors(num_files, 0);
+	int loaded = 0;
+	#pragma omp parallel for schedule(dynamic)
+	for (int i=0; i<num_files; i++) {
+		errors[i] = load_light(scene, i, width, height, t.red[i], t.green[i], t.blue[i]);
+		
+		#pragma omp critical
+		{
+			loaded++;
+			clog << "Loading file " << loaded << " of " << num_files << "\r";
+		}
+	}
+	
+	clog << "\n";
+	check_light_errors(errors, width, height);
+	
+	/* Wavelet transform rows of matrix, gathering the column statistics on the way */
+	clog << "Wavelet transforming " << width*height << " rows\n";
+	StatsAccumulator stats;
+	float **channels[3] = {t.red, t.green, t.blue};
+	ColumnStats *channel_stats[3] = {&t.red_stats, &t.green_stats, &t.blue_stats};
+	for (int c=0; c<3; c++) {
+		reset_stats(stats, num_files);
+		transform_pixel_rows(channels[c], num_files, width*height, scene.wavelet, &stats);
+		finish_stats(stats, *channel_stats[c]);
+	}
+}
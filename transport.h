@@ -0,0 +1,121 @@
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "image.h"
+#include "scene.h"
+
+#ifndef __INCLUDETRANSPORT
+#define __INCLUDETRANSPORT
+
+/* Per-column statistics of one channel of the (wavelet domain) transport */
+struct ColumnStats {
+	std::vector<float> mean; /* average intensity, used for weighting */
+	std::vector<float> norm; /* L2 norm */
+	std::vector<float> max_abs; /* largest magnitude */
+	std::vector<uint32_t> nonzeros;
+};
+
+/* Running sums behind ColumnStats, filled in as pixel rows are transformed */
+struct StatsAccumulator {
+	size_t pixels;
+	std::vector<double> sum;
+	std::vector<double> sum_squares;
+	std::vector<float> max_abs;
+	std::vector<uint32_t> nonzeros;
+};
+
+/* Alignment of every transport column, a cache line and the widest SIMD load */
+const size_t COLUMN_ALIGNMENT = 64;
+
+/*
+One buffer holding every column of the transport. Channel c of light i
+starts at data + (c*num_lights + i)*stride, with the stride rounded up from
+the pixel count so each column stays COLUMN_ALIGNMENT aligned. The cache file
+stores its columns the same way, so a mapped cache is used as the arena.
+The tiled and interleaved layouts keep their blocks in arenas too
+*/
+struct ColumnArena {
+	float *data;
+	size_t stride; /* floats from one column to the next */
+	size_t bytes;
+	bool mapped; /* allocated with mmap, for huge pages */
+};
+
+/* Columns of one channel, light i at data + i*stride */
+struct ChannelView {
+	const float *data;
+	size_t stride;
+};
+
+/*
+Light transport matrix for each color channel.
+red[i] points at the width*height pixels lit by light i, inside the arena
+allocated by build_transport_matrix or inside a mapped cache file.
+They are NULL once released in favour of another representation
+*/
+struct Transport {
+	unsigned int width;
+	unsigned int height;
+	unsigned int num_lights;
+	
+	float **red;
+	float **green;
+	float **blue;
+	
+	/* Statistics of each picture (after the wavelet transform) */
+	ColumnStats red_stats;
+	ColumnStats green_stats;
+	ColumnStats blue_stats;
+	
+	ColumnArena arena;
+	
+	/* Set when the arena lives in a mapped cache file */
+	void *mapping;
+	size_t mapping_size;
+};
+
+/* Pixels transformed together by transform_pixel_rows */
+const int PIXEL_BLOCK = 64;
+/* Blocks whose statistics are reduced together, in block order */
+const int STATS_CHUNK = 64;
+/* Lights copied per step of the transpose in transform_pixel_rows */
+const int TRANSPOSE_TILE = 16;
+
+/* Floats between the starts of consecutive columns of 'pixels' */
+inline size_t column_stride(size_t pixels) {
+	const size_t floats = COLUMN_ALIGNMENT / sizeof(float);
+	return (pixels + floats - 1) / floats * floats;
+}
+
+/* Returned by load_light for lights without an image */
+const unsigned LIGHT_MISSING = 1001;
+
+void allocate_arena(ColumnArena &arena, size_t floats, size_t columns);
+void free_arena(ColumnArena &arena);
+void allocate_transport(Transport &t, unsigned int width, unsigned int height, unsigned int num_lights);
+void point_columns(Transport &t, float *data, size_t stride);
+ChannelView channel_view(const Transport &t, int channel);
+void release_columns(Transport &t);
+void release_column_pages(Transport &t, int channel, unsigned int first, unsigned int count);
+void free_transport(Transport &t);
+unsigned load_light(const Scene &scene, int i, unsigned int width, unsigned int height,
+	float *red, float *green, float *blue);
+void check_light_errors(const std::vector<unsigned> &errors, unsigned int width, unsigned int height);
+std::vector< std::vector<float> > sample_pixel_rows(const Scene &scene, unsigned int resolution,
+	unsigned int stride);
+void transform_row(std::vector<float> &row, const Wavelet &wavelet, std::vector<float> &scratch);
+void transform_band(float *band, int num_lights, int pitch, int lanes, const Wavelet &wavelet,
+	std::vector<float> &scratch);
+void reset_stats(StatsAccumulator &stats, unsigned int num_lights);
+void finish_stats(const StatsAccumulator &stats, ColumnStats &out);
+void column_stats(const float *col, size_t pixels, ColumnStats &stats, int i);
+void transform_pixel_rows(float **cols, int num_lights, size_t count, const Wavelet &wavelet,
+	StatsAccumulator *stats);
+void patch_light_column(float **cols, int num_lights, size_t pixels, int light,
+	const Wavelet &wavelet,
+	const float *values, std::vector<char> &touched);
+void build_transport_matrix(Transport &t, const Scene &scene,
+	unsigned int width, unsigned int height, int num_threads);
+
+#endif
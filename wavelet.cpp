@@ -0,0 +1,523 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAAR_SIMD
+#endif
+
+#include "wavelet.h"
+
+using namespace std;
+
+const float SQRT2 = 1.41421356237309504880f;
+const float INV_SQRT2 = 0.70710678118654752440f;
+
+/*
+One level of the 1d haar transform over the first w entries of 'vec', 'stride'
+apart. Lifting in place: d = a - b, s = b + d/2 = (a + b)/2, then s and d are
+rescaled to keep the transform orthonormal. The averages land in the first
+half and the details in the second, which go through 'scratch' (w/2 floats)
+*/
+void haar(float *vec, int w, int stride, float *scratch){
+	int half = w / 2;
+	for (int i=0; i<half; i++) {
+		float a = vec[2*i*stride];
+		float b = vec[(2*i+1)*stride];
+		float d = a - b;
+		float s = b + 0.5f*d;
+		vec[i*stride] = s * SQRT2;
+		scratch[i] = d * INV_SQRT2;
+	}
+	for (int i=0; i<half; i++) {
+		vec[(half+i)*stride] = scratch[i];
+	}
+}
+
+/* Undoes one level of haar() */
+void inverse_haar(float *vec, int w, int stride, float *scratch){
+	int half = w / 2;
+	for (int i=0; i<half; i++) {
+		scratch[i] = vec[(half+i)*stride] * SQRT2;
+	}
+	/* Backwards so no average is overwritten before it is read */
+	for (int i=half-1; i>=0; i--) {
+		float s = vec[i*stride] * INV_SQRT2;
+		float d = scratch[i];
+		float b = s - 0.5f*d;
+		vec[2*i*stride] = b + d;
+		vec[(2*i+1)*stride] = b;
+	}
+}
+
+/*
+2d haar transform of one res x res face. Each level transforms the rows and
+then the columns of the remaining w x w low pass quadrant (nonstandard
+decomposition)
+*/
+void haar2d_face(float *face, int resolution, float *scratch){
+	for (int w=resolution; w>1; w/=2) {
+		for (int i=0; i<w; i++) haar(face + i*resolution, w, 1, scratch);
+		for (int i=0; i<w; i++) haar(face + i, w, resolution, scratch);
+	}
+}
+
+void inverse_haar2d_face(float *face, int resolution, float *scratch){
+	for (int w=2; w<=resolution; w*=2) {
+		for (int i=0; i<w; i++) inverse_haar(face + i, w, resolution, scratch);
+		for (int i=0; i<w; i++) inverse_haar(face + i*resolution, w, 1, scratch);
+	}
+}
+
+/*
+2d haar transform on each face of a cubemap. 'vec' holds the six faces one
+after another, so each face is res*res with res = sqrt(size/6). 'scratch' is
+grown as needed and can be reused across calls to avoid allocating
+*/
+void haar2d(vector<float>& vec, vector<float>& scratch){
+	int resolution = cubemap_resolution(vec.size());
+	int face_size = resolution*resolution;
+	if ((int) scratch.size() < resolution) scratch.resize(resolution);
+	
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		haar2d_face(&vec[f*face_size], resolution, &scratch[0]);
+	}
+}
+
+void inverse_haar2d(vector<float>& vec, vector<float>& scratch){
+	int resolution = cubemap_resolution(vec.size());
+	int face_size = resolution*resolution;
+	if ((int) scratch.size() < resolution) scratch.resize(resolution);
+	
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		inverse_haar2d_face(&vec[f*face_size], resolution, &scratch[0]);
+	}
+}
+
+void haar2d(vector<float>& vec){
+	vector<float> scratch;
+	haar2d(vec, scratch);
+}
+
+void inverse_haar2d(vector<float>& vec){
+	vector<float> scratch;
+	inverse_haar2d(vec, scratch);
+}
+
+/*
+Haar butterfly across 'lanes' independent signals at once:
+s = b + (a - b)/2 scaled by sqrt(2), d = (a - b) scaled by 1/sqrt(2), with the
+same operations as haar() so the results match it bit for bit. 's' may be 'a'
+*/
+typedef void (*Butterfly)(const float *a, const float *b, float *s, float *d, int lanes);
+
+static void butterfly_scalar(const float *a, const float *b, float *s, float *d, int lanes) {
+	for (int p=0; p<lanes; p++) {
+		float diff = a[p] - b[p];
+		float sum = b[p] + 0.5f*diff;
+		s[p] = sum * SQRT2;
+		d[p] = diff * INV_SQRT2;
+	}
+}
+
+#ifdef HAAR_SIMD
+static void butterfly_sse2(const float *a, const float *b, float *s, float *d, int lanes) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 sqrt2 = _mm_set1_ps(SQRT2);
+	const __m128 inv_sqrt2 = _mm_set1_ps(INV_SQRT2);
+	int p = 0;
+	for (; p+4<=lanes; p+=4) {
+		__m128 va = _mm_loadu_ps(a + p);
+		__m128 vb = _mm_loadu_ps(b + p);
+		__m128 diff = _mm_sub_ps(va, vb);
+		__m128 sum = _mm_add_ps(vb, _mm_mul_ps(half, diff));
+		_mm_storeu_ps(s + p, _mm_mul_ps(sum, sqrt2));
+		_mm_storeu_ps(d + p, _mm_mul_ps(diff, inv_sqrt2));
+	}
+	butterfly_scalar(a + p, b + p, s + p, d + p, lanes - p);
+}
+
+__attribute__((target("avx")))
+static void butterfly_avx(const float *a, const float *b, float *s, float *d, int lanes) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 sqrt2 = _mm256_set1_ps(SQRT2);
+	const __m256 inv_sqrt2 = _mm256_set1_ps(INV_SQRT2);
+	int p = 0;
+	for (; p+8<=lanes; p+=8) {
+		__m256 va = _mm256_loadu_ps(a + p);
+		__m256 vb = _mm256_loadu_ps(b + p);
+		__m256 diff = _mm256_sub_ps(va, vb);
+		__m256 sum = _mm256_add_ps(vb, _mm256_mul_ps(half, diff));
+		_mm256_storeu_ps(s + p, _mm256_mul_ps(sum, sqrt2));
+		_mm256_storeu_ps(d + p, _mm256_mul_ps(diff, inv_sqrt2));
+	}
+	butterfly_scalar(a + p, b + p, s + p, d + p, lanes - p);
+}
+#endif
+
+/* Widest butterfly this cpu runs, picked once at startup */
+static Butterfly select_butterfly() {
+	#ifdef HAAR_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) return butterfly_avx;
+	return butterfly_sse2;
+	#else
+	return butterfly_scalar;
+	#endif
+}
+
+static const Butterfly butterfly = select_butterfly();
+
+/*
+haar() over 'lanes' signals side by side: element j of every signal is the
+run of 'lanes' floats at vec + j*stride. 'scratch' holds (w/2)*lanes floats
+*/
+void haar_lanes(float *vec, int w, size_t stride, int lanes, float *scratch){
+	int half = w / 2;
+	for (int i=0; i<half; i++) {
+		butterfly(vec + 2*i*stride, vec + (2*i+1)*stride, vec + i*stride,
+			scratch + i*lanes, lanes);
+	}
+	for (int i=0; i<half; i++) {
+		memcpy(vec + (half+i)*stride, scratch + i*lanes, lanes*sizeof(float));
+	}
+}
+
+/*
+haar2d over a band of light vectors stored light major: light k of pixel p is
+band[k*pitch + p], for 'lanes' <= pitch pixels. Every butterfly then works on
+contiguous pixels and vectorizes across them
+*/
+void haar2d_lanes(float *band, int num_lights, int pitch, int lanes, vector<float>& scratch){
+	int resolution = cubemap_resolution(num_lights);
+	size_t face_size = (size_t)resolution*resolution*pitch;
+	size_t row_pitch = (size_t)resolution*pitch;
+	if (scratch.size() < (size_t)resolution*lanes) scratch.resize((size_t)resolution*lanes);
+	
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		float *face = band + f*face_size;
+		for (int w=resolution; w>1; w/=2) {
+			for (int i=0; i<w; i++) haar_lanes(face + i*row_pitch, w, pitch, lanes, &scratch[0]);
+			for (int i=0; i<w; i++) haar_lanes(face + (size_t)i*pitch, w, row_pitch, lanes, &scratch[0]);
+		}
+	}
+}
+
+/*
+Generic lifting engine for the other bases. A level splits the signal into
+even (average) and odd (detail) samples, runs the filter's lifting steps on
+them in place and then scales and deinterleaves. The boundary is periodic, so
+every level is exactly invertible however short the signal is
+*/
+struct LiftingStep {
+	bool odd;      /* updates the odd samples from the even ones, or the reverse */
+	float here;    /* weight of the other parity at the same index */
+	float next;    /* weight of the other parity at index + offset */
+	int offset;
+};
+
+struct HaarFilter {
+	enum {STEPS = 2, ORTHONORMAL = 1};
+	static const LiftingStep steps[STEPS];
+	static const float low, high;
+};
+const LiftingStep HaarFilter::steps[] = {
+	{true, -1.0f, 0.0f, 1},
+	{false, 0.5f, 0.0f, 1}
+};
+const float HaarFilter::low = SQRT2;
+const float HaarFilter::high = -INV_SQRT2;
+
+/* Daubechies 4 tap, orthonormal */
+struct D4Filter {
+	enum {STEPS = 3, ORTHONORMAL = 1};
+	static const LiftingStep steps[STEPS];
+	static const float low, high;
+};
+const float SQRT3 = 1.73205080756887729353f;
+const LiftingStep D4Filter::steps[] = {
+	{false, SQRT3, 0.0f, 1},
+	{true, -SQRT3/4, -(SQRT3 - 2)/4, -1},
+	{false, 0.0f, -1.0f, 1}
+};
+const float D4Filter::low = (SQRT3 - 1) * INV_SQRT2;
+const float D4Filter::high = (SQRT3 + 1) * INV_SQRT2;
+
+/*
+Cohen-Daubechies-Feauveau 9/7, biorthogonal. Scaled so the low pass keeps the
+orthonormal gain of sqrt(2); the transform is then within 15% of orthonormal
+*/
+struct CDF97Filter {
+	enum {STEPS = 4, ORTHONORMAL = 0};
+	static const LiftingStep steps[STEPS];
+	static const float low, high;
+};
+const LiftingStep CDF97Filter::steps[] = {
+	{true, -1.586134342f, -1.586134342f, 1},
+	{false, -0.05298011857f, -0.05298011857f, -1},
+	{true, 0.8829110755f, 0.8829110755f, 1},
+	{false, 0.4435068520f, 0.4435068520f, -1}
+};
+const float CDF97Filter::low = 1.149604398f;
+const float CDF97Filter::high = 0.8698644516f;
+
+/* Adds here*other[i] + next*other[i+offset] to every sample of one parity */
+static inline void lifting_step(float *vec, int half, size_t stride, int lanes,
+	bool odd, float here, float next, int offset) {
+	int target = odd ? 1 : 0;
+	int source = 1 - target;
+	for (int i=0; i<half; i++) {
+		int j = (i + offset + half) % half;
+		float *t = vec + (2*i + target)*stride;
+		const float *a = vec + (2*i + source)*stride;
+		const float *b = vec + (2*j + source)*stride;
+		for (int p=0; p<lanes; p++) t[p] += here*a[p] + next*b[p];
+	}
+}
+
+/*
+One level of 'Filter' over 'lanes' signals side by side, laid out as in
+haar_lanes; 'scratch' holds w*lanes floats.
+WAVELET_DUAL applies W^-T instead of W: the transpose of a step that lifts one
+parity from the other lifts the other parity with the offset reversed, so the
+dual runs the same steps with swapped parities, negated weights and inverted
+scales
+*/
+template <class Filter, int MODE>
+static void lift_lanes(float *vec, int w, size_t stride, int lanes, float *scratch) {
+	const int half = w / 2;
+	const bool dual = MODE == WAVELET_DUAL;
+	const float low = dual ? 1.0f / Filter::low : Filter::low;
+	const float high = dual ? 1.0f / Filter::high : Filter::high;
+	
+	if (MODE == WAVELET_INVERSE) {
+		for (int i=0; i<half; i++) {
+			for (int p=0; p<lanes; p++) {
+				scratch[2*i*lanes + p] = vec[i*stride + p] / low;
+				scratch[(2*i+1)*lanes + p] = vec[(half+i)*stride + p] / high;
+			}
+		}
+		for (int j=0; j<w; j++)
+			memcpy(vec + j*stride, scratch + j*lanes, lanes*sizeof(float));
+		for (int k=Filter::STEPS-1; k>=0; k--) {
+			const LiftingStep &step = Filter::steps[k];
+			lifting_step(vec, half, stride, lanes, step.odd, -step.here, -step.next, step.offset);
+		}
+		return;
+	}
+	
+	for (int k=0; k<Filter::STEPS; k++) {
+		const LiftingStep &step = Filter::steps[k];
+		if (dual)
+			lifting_step(vec, half, stride, lanes, !step.odd, -step.here, -step.next, -step.offset);
+		else
+			lifting_step(vec, half, stride, lanes, step.odd, step.here, step.next, step.offset);
+	}
+	for (int i=0; i<half; i++) {
+		for (int p=0; p<lanes; p++) {
+			scratch[i*lanes + p] = vec[2*i*stride + p] * low;
+			scratch[(half+i)*lanes + p] = vec[(2*i+1)*stride + p] * high;
+		}
+	}
+	for (int j=0; j<w; j++)
+		memcpy(vec + j*stride, scratch + j*lanes, lanes*sizeof(float));
+}
+
+/* Rows then columns of the w x w low pass quadrant, or the reverse to invert */
+template <class Filter, int MODE>
+static void nonstandard_level(float *face, int resolution, int w, int pitch, int lanes, float *scratch) {
+	size_t row_pitch = (size_t)resolution*pitch;
+	if (MODE == WAVELET_INVERSE) {
+		for (int i=0; i<w; i++) lift_lanes<Filter, MODE>(face + (size_t)i*pitch, w, row_pitch, lanes, scratch);
+		for (int i=0; i<w; i++) lift_lanes<Filter, MODE>(face + i*row_pitch, w, pitch, lanes, scratch);
+	} else {
+		for (int i=0; i<w; i++) lift_lanes<Filter, MODE>(face + i*row_pitch, w, pitch, lanes, scratch);
+		for (int i=0; i<w; i++) lift_lanes<Filter, MODE>(face + (size_t)i*pitch, w, row_pitch, lanes, scratch);
+	}
+}
+
+/* haar2d_face's nonstandard decomposition with 'Filter', over a band of faces */
+template <class Filter, int MODE>
+static void nonstandard_face(float *face, int resolution, int pitch, int lanes, float *scratch) {
+	if (MODE == WAVELET_INVERSE) {
+		for (int w=2; w<=resolution; w*=2)
+			nonstandard_level<Filter, MODE>(face, resolution, w, pitch, lanes, scratch);
+	} else {
+		for (int w=resolution; w>1; w/=2)
+			nonstandard_level<Filter, MODE>(face, resolution, w, pitch, lanes, scratch);
+	}
+}
+
+/*
+Standard decomposition: all levels along every row, then all levels along
+every column. Its dual is the dual of each pass in the same order, and its
+inverse undoes the columns first
+*/
+template <class Filter, int MODE>
+static void standard_face(float *face, int resolution, int pitch, int lanes, float *scratch) {
+	size_t row_pitch = (size_t)resolution*pitch;
+	if (MODE == WAVELET_INVERSE) {
+		for (int i=0; i<resolution; i++)
+			for (int w=2; w<=resolution; w*=2)
+				lift_lanes<Filter, MODE>(face + (size_t)i*pitch, w, row_pitch, lanes, scratch);
+		for (int i=0; i<resolution; i++)
+			for (int w=2; w<=resolution; w*=2)
+				lift_lanes<Filter, MODE>(face + i*row_pitch, w, pitch, lanes, scratch);
+	} else {
+		for (int i=0; i<resolution; i++)
+			for (int w=resolution; w>1; w/=2)
+				lift_lanes<Filter, MODE>(face + i*row_pitch, w, pitch, lanes, scratch);
+		for (int i=0; i<resolution; i++)
+			for (int w=resolution; w>1; w/=2)
+				lift_lanes<Filter, MODE>(face + (size_t)i*pitch, w, row_pitch, lanes, scratch);
+	}
+}
+
+template <class Filter, int MODE>
+static void lift2d_face(float *face, int resolution, int pitch, int lanes, int decomposition,
+	float *scratch) {
+	if (decomposition == STANDARD)
+		standard_face<Filter, MODE>(face, resolution, pitch, lanes, scratch);
+	else
+		nonstandard_face<Filter, MODE>(face, resolution, pitch, lanes, scratch);
+}
+
+/* An orthonormal filter is its own dual, so those use the forward kernel */
+template <class Filter>
+static void lift2d_cubemap(float *band, int resolution, int pitch, int lanes, int decomposition,
+	int mode, float *scratch) {
+	size_t face_size = (size_t)resolution*resolution*pitch;
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		float *face = band + f*face_size;
+		if (mode == WAVELET_INVERSE)
+			lift2d_face<Filter, WAVELET_INVERSE>(face, resolution, pitch, lanes, decomposition, scratch);
+		else if (mode == WAVELET_DUAL && !Filter::ORTHONORMAL)
+			lift2d_face<Filter, WAVELET_DUAL>(face, resolution, pitch, lanes, decomposition, scratch);
+		else
+			lift2d_face<Filter, WAVELET_FORWARD>(face, resolution, pitch, lanes, decomposition, scratch);
+	}
+}
+
+/*
+Transforms a band of light vectors (laid out as for haar2d_lanes) with
+'wavelet'. The environment is transformed WAVELET_FORWARD and the transport
+rows WAVELET_DUAL, so their dot product is the same as before the transform
+for biorthogonal bases too
+*/
+void wavelet2d_lanes(float *band, int num_lights, int pitch, int lanes, const Wavelet &wavelet,
+	int mode, vector<float>& scratch){
+	int resolution = cubemap_resolution(num_lights);
+	int decomposition = wavelet.decomposition;
+	if (scratch.size() < (size_t)resolution*lanes) scratch.resize((size_t)resolution*lanes);
+	
+	switch (wavelet.basis) {
+	case WAVELET_HAAR:
+		if (mode == WAVELET_INVERSE || decomposition == STANDARD)
+			lift2d_cubemap<HaarFilter>(band, resolution, pitch, lanes, decomposition, mode, &scratch[0]);
+		else
+			haar2d_lanes(band, num_lights, pitch, lanes, scratch);
+		break;
+	case WAVELET_D4:
+		lift2d_cubemap<D4Filter>(band, resolution, pitch, lanes, decomposition, mode, &scratch[0]);
+		break;
+	case WAVELET_CDF97:
+		lift2d_cubemap<CDF97Filter>(band, resolution, pitch, lanes, decomposition, mode, &scratch[0]);
+		break;
+	}
+}
+
+void wavelet2d(vector<float>& vec, const Wavelet &wavelet, int mode, vector<float>& scratch){
+	if (wavelet.basis == WAVELET_HAAR && wavelet.decomposition == NONSTANDARD) {
+		if (mode == WAVELET_INVERSE) inverse_haar2d(vec, scratch);
+		else haar2d(vec, scratch);
+		return;
+	}
+	wavelet2d_lanes(&vec[0], vec.size(), 1, 1, wavelet, mode, scratch);
+}
+
+template <class Filter>
+static void level_cubemap(float *band, int resolution, int w, int pitch, int lanes, int mode,
+	float *scratch) {
+	size_t face_size = (size_t)resolution*resolution*pitch;
+	for (int f=0; f<CUBEMAP_FACES; f++) {
+		float *face = band + f*face_size;
+		if (mode == WAVELET_INVERSE)
+			nonstandard_level<Filter, WAVELET_INVERSE>(face, resolution, w, pitch, lanes, scratch);
+		else if (mode == WAVELET_DUAL && !Filter::ORTHONORMAL)
+			nonstandard_level<Filter, WAVELET_DUAL>(face, resolution, w, pitch, lanes, scratch);
+		else
+			nonstandard_level<Filter, WAVELET_FORWARD>(face, resolution, w, pitch, lanes, scratch);
+	}
+}
+
+/*
+The single level of the nonstandard decomposition that works on the w x w
+low pass quadrant of every face, so levels can be timed on their own.
+Running it for w = resolution down to 2 (2 up to resolution when inverting)
+is the same as wavelet2d_lanes with a NONSTANDARD wavelet
+*/
+void wavelet2d_level(float *band, int num_lights, int pitch, int lanes, int w, int basis,
+	int mode, vector<float>& scratch){
+	int resolution = cubemap_resolution(num_lights);
+	if (scratch.size() < (size_t)resolution*lanes) scratch.resize((size_t)resolution*lanes);
+	
+	switch (basis) {
+	case WAVELET_HAAR:
+		if (mode == WAVELET_INVERSE) {
+			level_cubemap<HaarFilter>(band, resolution, w, pitch, lanes, mode, &scratch[0]);
+		} else {
+			size_t row_pitch = (size_t)resolution*pitch;
+			for (int f=0; f<CUBEMAP_FACES; f++) {
+				float *face = band + f*resolution*row_pitch;
+				for (int i=0; i<w; i++) haar_lanes(face + i*row_pitch, w, pitch, lanes, &scratch[0]);
+				for (int i=0; i<w; i++) haar_lanes(face + (size_t)i*pitch, w, row_pitch, lanes, &scratch[0]);
+			}
+		}
+		break;
+	case WAVELET_D4:
+		level_cubemap<D4Filter>(band, resolution, w, pitch, lanes, mode, &scratch[0]);
+		break;
+	case WAVELET_CDF97:
+		level_cubemap<CDF97Filter>(band, resolution, w, pitch, lanes, mode, &scratch[0]);
+		break;
+	}
+}
+
+static const char *WAVELET_NAMES[NUM_WAVELETS] = {"haar", "d4", "cdf97"};
+
+/* Basis called 'name', or -1 */
+int wavelet_basis(const char *name){
+	for (int b=0; b<NUM_WAVELETS; b++)
+		if (strcmp(name, WAVELET_NAMES[b]) == 0) return b;
+	return -1;
+}
+
+const char *wavelet_name(int basis){
+	return WAVELET_NAMES[basis];
+}
+
+static const char *DECOMPOSITION_NAMES[NUM_DECOMPOSITIONS] = {"nonstandard", "standard"};
+
+/* Decomposition called 'name', or -1 */
+int decomposition_type(const char *name){
+	for (int d=0; d<NUM_DECOMPOSITIONS; d++)
+		if (strcmp(name, DECOMPOSITION_NAMES[d]) == 0) return d;
+	return -1;
+}
+
+const char *decomposition_name(int decomposition){
+	return DECOMPOSITION_NAMES[decomposition];
+}
+
+/* Side length of one face of a cubemap holding 'size' entries */
+int cubemap_resolution(size_t size){
+	int resolution = (int) floor(sqrt(size / (double) CUBEMAP_FACES) + 0.5);
+	if ((size_t) CUBEMAP_FACES*resolution*resolution != size) {
+		cout << "Vector of " << size << " entries is not a cubemap" << endl;
+		exit(1);
+	}
+	return resolution;
+}
@@ -0,0 +1,49 @@
+#include <cstddef>
+#include <vector>
+
+#ifndef __INCLUDEWAVELET
+#define __INCLUDEWAVELET
+
+/* Define this if you want to use the wavelet transform (haar unless the scene picks another basis) */
+#define USEHAAR
+
+const int CUBEMAP_FACES = 6;
+
+/* Wavelet bases a scene can use, and the directions they can be applied in */
+enum {WAVELET_HAAR, WAVELET_D4, WAVELET_CDF97, NUM_WAVELETS};
+enum {WAVELET_FORWARD, WAVELET_DUAL, WAVELET_INVERSE};
+
+/*
+How the 2d transform of a face combines its rows and columns. Nonstandard
+alternates one row and one column level on the shrinking low pass quadrant,
+standard transforms every row through all levels and then every column
+*/
+enum {NONSTANDARD, STANDARD, NUM_DECOMPOSITIONS};
+
+struct Wavelet {
+	int basis;
+	int decomposition;
+};
+
+void haar(float *vec, int w, int stride, float *scratch);
+void inverse_haar(float *vec, int w, int stride, float *scratch);
+void haar2d_face(float *face, int resolution, float *scratch);
+void inverse_haar2d_face(float *face, int resolution, float *scratch);
+void haar2d(std::vector<float>& vec, std::vector<float>& scratch);
+void inverse_haar2d(std::vector<float>& vec, std::vector<float>& scratch);
+void haar2d(std::vector<float>& vec);
+void haar_lanes(float *vec, int w, size_t stride, int lanes, float *scratch);
+void haar2d_lanes(float *band, int num_lights, int pitch, int lanes, std::vector<float>& scratch);
+void inverse_haar2d(std::vector<float>& vec);
+void wavelet2d(std::vector<float>& vec, const Wavelet &wavelet, int mode, std::vector<float>& scratch);
+void wavelet2d_lanes(float *band, int num_lights, int pitch, int lanes, const Wavelet &wavelet,
+	int mode, std::vector<float>& scratch);
+void wavelet2d_level(float *band, int num_lights, int pitch, int lanes, int w, int basis,
+	int mode, std::vector<float>& scratch);
+int wavelet_basis(const char *name);
+const char *wavelet_name(int basis);
+int decomposition_type(const char *name);
+const char *decomposition_name(int decomposition);
+int cubemap_resolution(size_t size);
+
+#endif
@@ -0,0 +1,101 @@
+/* Reports how compactly each wavelet variant stores a scene's transport rows:  */
+/*     ./wavelet_report [-r resolution] [path/to/scene/folder ...]               */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "omp.h"
+
+#include "transport.h"
+#include "wavelet.h"
+
+using namespace std;
+
+const double ENERGIES[] = {0.99, 0.999};
+const int NUM_ENERGIES = 2;
+const unsigned int PIXEL_STRIDE = 16;
+
+/* Fewest coefficients of 'coeffs' holding 'fraction' of its energy */
+size_t coefficients_for_energy(const vector<float> &coeffs, double fraction) {
+	vector<double> energy(coeffs.size());
+	double total = 0.0;
+	for (size_t i=0; i<coeffs.size(); i++) {
+		energy[i] = (double)coeffs[i]*coeffs[i];
+		total += energy[i];
+	}
+	sort(energy.rbegin(), energy.rend());
+
+	double kept = 0.0;
+	size_t count = 0;
+	while (count < energy.size() && kept < fraction*total)
+		kept += energy[count++];
+	return count;
+}
+
+void report_scene(const char *folder, unsigned int resolution) {
+	Scene scene;
+	load_scene(scene, folder);
+	vector< vector<float> > rows = sample_pixel_rows(scene, resolution, PIXEL_STRIDE);
+
+	cout << folder << ": " << scene.files.size() << " lights, " << rows.size()
+		<< " lit pixels (every " << PIXEL_STRIDE << "th)" << endl;
+	cout << "   " << setw(18) << left << "coefficients for" << right;
+	for (int e=0; e<NUM_ENERGIES; e++)
+		cout << setw(9) << setprecision(1) << fixed << ENERGIES[e]*100 << "%";
+	cout << " of the energy, mean per pixel row" << endl;
+
+	for (int b=0; b<NUM_WAVELETS; b++) {
+		for (int d=0; d<NUM_DECOMPOSITIONS; d++) {
+			Wavelet wavelet = {b, d};
+			vector<double> counts(NUM_ENERGIES, 0.0);
+
+			#pragma omp parallel
+			{
+				vector<float> coeffs, scratch;
+				vector<double> partial(NUM_ENERGIES, 0.0);
+				#pragma omp for schedule(static)
+				for (int r=0; r<(int)rows.size(); r++) {
+					coeffs = rows[r];
+					transform_row(coeffs, wavelet, scratch);
+					for (int e=0; e<NUM_ENERGIES; e++)
+						partial[e] += coefficients_for_energy(coeffs, ENERGIES[e]);
+				}
+				#pragma omp critical
+				for (int e=0; e<NUM_ENERGIES; e++) counts[e] += partial[e];
+			}
+
+			cout << "   " << setw(6) << left << wavelet_name(b) << setw(12)
+				<< decomposition_name(d) << right;
+			for (int e=0; e<NUM_ENERGIES; e++)
+				cout << setw(10) << setprecision(1) << counts[e] / max((size_t)1, rows.size());
+			cout << endl;
+		}
+	}
+	cout << endl;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned int resolution = 256;
+	vector<const char*> folders;
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i+1 < argc)
+			resolution = atoi(argv[++i]);
+		else
+			folders.push_back(argv[i]);
+	}
+	if (folders.empty()) {
+		folders.push_back("scenes/sphere");
+		folders.push_back("scenes/teapot");
+		folders.push_back("scenes/tree");
+	}
+
+	cout << "Energy is measured on the stored (dual) coefficients, exact for the" << endl
+		<< "orthonormal haar and d4 and approximate for cdf97" << endl << endl;
+	for (unsigned int f=0; f<folders.size(); f++)
+		report_scene(folders[f], resolution);
+	return 0;
+}